@@ -0,0 +1,550 @@
+// ntr-bench: micro-benchmarks for the work done on every frame, each measured on its own using the
+// same functions the network thread and the plugin call. Frames are synthetic but shaped like
+// NTR's: rotated, 4:2:0 JPEGs at quality 80, split into packets the way NTR splits them.
+//
+// Each benchmark runs a number of times, each run repeating it for a few tens of milliseconds, and
+// reports the median time per frame across runs along with the median absolute deviation. Results
+// are compared against a baseline file, and the run fails if any benchmark got slower by more than
+// the tolerance (and by more than its own noise). --write-baseline records the current results
+// as the new baseline instead.
+//
+//     ntr-bench --baseline bench/baseline.txt [--write-baseline] [--tolerance 10] [--filter decode]
+
+#include "ntr-connection.h"
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_QUALITY 80
+#define WARMUP_RUNS 3
+#define MEASURED_RUNS 21
+#define RUN_DURATION_NS 20000000ULL
+#define CALIBRATION_DURATION_NS 2000000ULL
+#define DEFAULT_TOLERANCE_PERCENT 10.0
+#define MAX_BASELINE_ENTRIES 64
+
+struct bench_frame
+{
+	unsigned char *frame_data;
+	unsigned long frame_size;
+
+	struct ntr_data_packet packets[DATA_PACKET_MAX_COUNT];
+	int packet_sizes[DATA_PACKET_MAX_COUNT];
+	int packet_count;
+};
+
+struct bench_context
+{
+	enum ntr_screen screen;
+	struct bench_frame frames[SCREEN_COUNT];
+
+	struct ntr_frame_data slots[CONCURRENT_FRAMES];
+	int slot_counts[SCREEN_COUNT];
+	tjhandle decompressor_handle;
+	unsigned char *image_data;
+	unsigned char *tick_image_data;
+	struct ntr_connection_data *connection_data;
+};
+
+typedef void (*bench_kernel_t)(struct bench_context *context);
+
+struct bench_case
+{
+	const char *name;
+	bench_kernel_t kernel;
+
+	// Whether throughput is counted in decoded (RGBA) bytes rather than compressed bytes.
+	bool counts_image_bytes;
+};
+
+struct bench_result
+{
+	char name[64];
+	double median_ns;
+	double mad_ns;
+	double bytes_per_second;
+};
+
+struct baseline_entry
+{
+	char name[64];
+	double median_ns;
+};
+
+// Keeps the compiler from discarding results that are otherwise unused.
+static volatile uintptr_t bench_sink;
+
+static void log_to_stderr(int log_level, const char *format, va_list args, void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (log_level <= LOG_INFO)
+	{
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+	}
+}
+
+static const char *screen_name(enum ntr_screen screen)
+{
+	return screen == SCREEN_TOP ? "top" : "bottom";
+}
+
+// Something like a game screen: a smooth background, flat tiles with hard edges, and a patch of
+// fine detail, which gives JPEG sizes in the same range NTR sends.
+static void bench_fill_image(unsigned char *image_data, int width, int height, unsigned int seed)
+{
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			unsigned char *pixel = image_data + (y * width + x) * 4;
+
+			seed = seed * 1103515245 + 12345;
+			int noise = (seed >> 16) & 0x1F;
+
+			if ((x / 24 + y / 16) % 5 == 0)
+			{
+				pixel[0] = (unsigned char)(40 + (x / 24) * 13);
+				pixel[1] = (unsigned char)(200 - (y / 16) * 7);
+				pixel[2] = 90;
+			}
+			else if (x > width / 2 && y > height / 2 && y < height * 3 / 4)
+			{
+				pixel[0] = (unsigned char)(noise * 8);
+				pixel[1] = (unsigned char)(255 - noise * 8);
+				pixel[2] = (unsigned char)((x ^ y) & 0xFF);
+			}
+			else
+			{
+				pixel[0] = (unsigned char)(x * 255 / width);
+				pixel[1] = (unsigned char)(y * 255 / height);
+				pixel[2] = (unsigned char)(128 + noise);
+			}
+			pixel[3] = 255;
+		}
+	}
+}
+
+static bool bench_make_frame(enum ntr_screen screen, struct bench_frame *frame)
+{
+	// Frames from NTR are rotated; the image is SCREEN_HEIGHT wide and SCREEN_WIDTH tall.
+	int width = SCREEN_HEIGHT[screen];
+	int height = SCREEN_WIDTH[screen];
+
+	unsigned char *image_data = bmalloc(width * height * 4);
+	bench_fill_image(image_data, width, height, 1 + screen);
+
+	tjhandle compressor_handle = tjInitCompress();
+	frame->frame_data = NULL;
+	frame->frame_size = 0;
+	int compress_result = tjCompress2(compressor_handle, image_data, width, width * 4, height, TJPF_RGBA,
+		&frame->frame_data, &frame->frame_size, TJSAMP_420, BENCH_QUALITY, TJFLAG_FASTDCT);
+	tjDestroy(compressor_handle);
+	bfree(image_data);
+
+	if (compress_result != 0 || frame->frame_size > DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT)
+	{
+		blog(LOG_ERROR, "ntr-bench: Unable to create a test frame for the %s screen", screen_name(screen));
+		return false;
+	}
+
+	frame->packet_count = (int)((frame->frame_size + DATA_PACKET_DATA_SIZE - 1) / DATA_PACKET_DATA_SIZE);
+	for (int packet_index = 0; packet_index < frame->packet_count; packet_index++)
+	{
+		struct ntr_data_packet *packet = &frame->packets[packet_index];
+		int data_size = (int)(packet_index < frame->packet_count - 1 ? DATA_PACKET_DATA_SIZE :
+			frame->frame_size - DATA_PACKET_DATA_SIZE * packet_index);
+
+		memset(packet, 0, sizeof(struct ntr_data_packet));
+		packet->id = 1;
+		packet->is_top = screen == SCREEN_TOP;
+		packet->is_last = packet_index == frame->packet_count - 1;
+		packet->order = (unsigned char)packet_index;
+		memcpy(packet->data, frame->frame_data + DATA_PACKET_DATA_SIZE * packet_index, data_size);
+
+		frame->packet_sizes[packet_index] = data_size + 4;
+	}
+
+	return true;
+}
+
+// Each screen only searches its own share of the slots. The frame being looked up sits in the last
+// of them, with other frames of the same screen ahead of it.
+static void bench_reset_slots(struct bench_context *context)
+{
+	int slot_count = context->slot_counts[context->screen];
+
+	for (int slot_index = 0; slot_index < slot_count; slot_index++)
+	{
+		struct ntr_frame_data *slot = &context->slots[slot_index];
+		slot->id = (unsigned char)(slot_index == slot_count - 1 ? 1 : 100 + slot_index);
+		slot->is_top = context->screen == SCREEN_TOP;
+		slot->time_started = 1000 + slot_index;
+		slot->packet_count = 0;
+		slot->expected_packet_count = 0;
+	}
+}
+
+static void bench_slot_lookup(struct bench_context *context)
+{
+	struct bench_frame *frame = &context->frames[context->screen];
+
+	for (int packet_index = 0; packet_index < frame->packet_count; packet_index++)
+	{
+		bench_sink += (uintptr_t)obs_ntr_find_frame_slot(context->slots, context->slot_counts[context->screen], &frame->packets[packet_index]);
+	}
+}
+
+static void bench_reassembly(struct bench_context *context)
+{
+	struct bench_frame *frame = &context->frames[context->screen];
+	struct ntr_frame_data *slot = &context->slots[context->slot_counts[context->screen] - 1];
+
+	slot->packet_count = 0;
+	for (int packet_index = 0; packet_index < frame->packet_count; packet_index++)
+	{
+		obs_ntr_store_packet(slot, &frame->packets[packet_index], frame->packet_sizes[packet_index]);
+	}
+
+	bench_sink += slot->packet_count;
+}
+
+static void bench_decode(struct bench_context *context)
+{
+	struct bench_frame *frame = &context->frames[context->screen];
+
+	bench_sink += obs_ntr_decode_image(context->decompressor_handle, context->screen, frame->frame_data, (int)frame->frame_size,
+		context->image_data);
+}
+
+static void bench_handoff(struct bench_context *context)
+{
+	obs_ntr_publish_frame(context->connection_data, context->screen, 1, context->image_data);
+}
+
+// Everything the plugin's upload tick does for a screen before gs_texture_set_image, apart from
+// comparing frame ids. Cropped sources do the same kind of copy, of just their region.
+static void bench_tick_copy(struct bench_context *context)
+{
+	bench_sink += obs_ntr_copy_latest_frame(context->connection_data, context->screen, context->tick_image_data);
+}
+
+static const struct bench_case BENCH_CASES[] =
+{
+	{ "slot_lookup", bench_slot_lookup, false },
+	{ "reassembly", bench_reassembly, false },
+	{ "decode", bench_decode, false },
+	{ "handoff", bench_handoff, true },
+	{ "tick_copy", bench_tick_copy, true },
+};
+#define BENCH_CASE_COUNT (sizeof(BENCH_CASES) / sizeof(BENCH_CASES[0]))
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double first = *(const double *)a;
+	double second = *(const double *)b;
+	return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+static double median(double *values, int count)
+{
+	qsort(values, count, sizeof(double), compare_doubles);
+	return count % 2 == 1 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+static double time_iterations(bench_kernel_t kernel, struct bench_context *context, long iterations)
+{
+	uint64_t start_time = os_gettime_ns();
+	for (long iteration = 0; iteration < iterations; iteration++)
+	{
+		kernel(context);
+	}
+	return (double)(os_gettime_ns() - start_time);
+}
+
+static void run_bench(const struct bench_case *bench_case, struct bench_context *context, struct bench_result *result)
+{
+	// Pick an iteration count that makes each run last about RUN_DURATION_NS.
+	long iterations = 1;
+	double elapsed_ns = time_iterations(bench_case->kernel, context, iterations);
+	while (elapsed_ns < CALIBRATION_DURATION_NS)
+	{
+		iterations *= 2;
+		elapsed_ns = time_iterations(bench_case->kernel, context, iterations);
+	}
+	iterations = (long)(iterations * (RUN_DURATION_NS / elapsed_ns)) + 1;
+
+	double run_ns[MEASURED_RUNS];
+	for (int run_index = 0; run_index < WARMUP_RUNS + MEASURED_RUNS; run_index++)
+	{
+		double ns_per_frame = time_iterations(bench_case->kernel, context, iterations) / iterations;
+		if (run_index >= WARMUP_RUNS)
+		{
+			run_ns[run_index - WARMUP_RUNS] = ns_per_frame;
+		}
+	}
+
+	result->median_ns = median(run_ns, MEASURED_RUNS);
+
+	double deviations[MEASURED_RUNS];
+	for (int run_index = 0; run_index < MEASURED_RUNS; run_index++)
+	{
+		deviations[run_index] = fabs(run_ns[run_index] - result->median_ns);
+	}
+	result->mad_ns = median(deviations, MEASURED_RUNS);
+
+	double frame_bytes = bench_case->counts_image_bytes ? SCREEN_WIDTH[context->screen] * SCREEN_HEIGHT[context->screen] * 4.0 :
+		(double)context->frames[context->screen].frame_size;
+	result->bytes_per_second = frame_bytes / (result->median_ns / 1000000000.0);
+}
+
+static int read_baseline(const char *path, struct baseline_entry *entries)
+{
+	FILE *baseline_file = os_fopen(path, "r");
+	if (baseline_file == NULL)
+	{
+		return -1;
+	}
+
+	int entry_count = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), baseline_file) != NULL && entry_count < MAX_BASELINE_ENTRIES)
+	{
+		if (line[0] == '#')
+		{
+			continue;
+		}
+
+		if (sscanf(line, "%63s %lf", entries[entry_count].name, &entries[entry_count].median_ns) == 2)
+		{
+			entry_count++;
+		}
+	}
+
+	fclose(baseline_file);
+	return entry_count;
+}
+
+static bool write_baseline(const char *path, const struct bench_result *results, int result_count)
+{
+	FILE *baseline_file = os_fopen(path, "w");
+	if (baseline_file == NULL)
+	{
+		return false;
+	}
+
+	fprintf(baseline_file, "# ntr-bench baseline: benchmark, median ns/frame\n");
+	for (int result_index = 0; result_index < result_count; result_index++)
+	{
+		fprintf(baseline_file, "%s %.1f\n", results[result_index].name, results[result_index].median_ns);
+	}
+
+	fclose(baseline_file);
+	return true;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"usage: ntr-bench [options]\n"
+		"\n"
+		"  --baseline <path>        baseline file to compare against (or write)\n"
+		"  --write-baseline         record these results as the baseline instead of comparing\n"
+		"  --tolerance <percent>    slowdown allowed before a benchmark counts as a regression (default 10)\n"
+		"  --filter <text>          only run benchmarks whose names contain this\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *baseline_path = NULL;
+	const char *filter = NULL;
+	bool should_write_baseline = false;
+	double tolerance = DEFAULT_TOLERANCE_PERCENT / 100.0;
+
+	for (int arg_index = 1; arg_index < argc; arg_index++)
+	{
+		const char *arg = argv[arg_index];
+		const char *value = arg_index + 1 < argc ? argv[arg_index + 1] : NULL;
+
+		if (strcmp(arg, "--write-baseline") == 0)
+		{
+			should_write_baseline = true;
+			continue;
+		}
+		else if (value == NULL)
+		{
+			print_usage();
+			return 1;
+		}
+		else if (strcmp(arg, "--baseline") == 0)
+		{
+			baseline_path = value;
+		}
+		else if (strcmp(arg, "--tolerance") == 0)
+		{
+			tolerance = atof(value) / 100.0;
+		}
+		else if (strcmp(arg, "--filter") == 0)
+		{
+			filter = value;
+		}
+		else
+		{
+			print_usage();
+			return 1;
+		}
+
+		arg_index++;
+	}
+
+	if (should_write_baseline && baseline_path == NULL)
+	{
+		print_usage();
+		return 1;
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	// Comparing against a baseline that isn't there would pass without checking anything.
+	struct baseline_entry baseline[MAX_BASELINE_ENTRIES];
+	int baseline_count = 0;
+	if (baseline_path != NULL && !should_write_baseline)
+	{
+		baseline_count = read_baseline(baseline_path, baseline);
+		if (baseline_count < 0)
+		{
+			blog(LOG_ERROR, "ntr-bench: No baseline at %s; run with --write-baseline to record one first", baseline_path);
+			return 1;
+		}
+	}
+
+	struct bench_context context;
+	memset(&context, 0, sizeof(struct bench_context));
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		if (!bench_make_frame(screen_index, &context.frames[screen_index]))
+		{
+			return 1;
+		}
+	}
+
+	for (int slot_index = 0; slot_index < CONCURRENT_FRAMES; slot_index++)
+	{
+		context.slots[slot_index].frame_data = bzalloc(DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT);
+	}
+
+	// Divided as for NTR's usual setting of twice as many top screen frames.
+	double slot_weights[SCREEN_COUNT];
+	slot_weights[SCREEN_TOP] = 2.0;
+	slot_weights[SCREEN_BOTTOM] = 1.0;
+	obs_ntr_divide_frame_slots(slot_weights, context.slot_counts);
+
+	context.decompressor_handle = tjInitDecompress();
+	context.image_data = bzalloc(TEMP_BUFFER_SIZE);
+	context.tick_image_data = bzalloc(TEMP_BUFFER_SIZE);
+	context.connection_data = obs_ntr_connection_alloc();
+
+	struct bench_result results[SCREEN_COUNT * BENCH_CASE_COUNT];
+	int result_count = 0;
+	int regression_count = 0;
+
+	printf("%-22s %12s %10s %10s %12s %8s\n", "benchmark", "ns/frame", "MAD", "MB/s", "baseline", "change");
+
+	for (int screen_index = SCREEN_COUNT - 1; screen_index >= 0; screen_index--)
+	{
+		context.screen = screen_index;
+
+		for (size_t case_index = 0; case_index < BENCH_CASE_COUNT; case_index++)
+		{
+			struct bench_result *result = &results[result_count];
+			snprintf(result->name, sizeof(result->name), "%s.%s", screen_name(screen_index), BENCH_CASES[case_index].name);
+
+			if (filter != NULL && strstr(result->name, filter) == NULL)
+			{
+				continue;
+			}
+
+			// Decode once up front so the handoff and tick copies move a real image.
+			bench_reset_slots(&context);
+			bench_decode(&context);
+			obs_ntr_publish_frame(context.connection_data, context.screen, 1, context.image_data);
+
+			run_bench(&BENCH_CASES[case_index], &context, result);
+			result_count++;
+
+			printf("%-22s %12.1f %10.1f %10.1f", result->name, result->median_ns, result->mad_ns,
+				result->bytes_per_second / (1024.0 * 1024.0));
+
+			const struct baseline_entry *baseline_entry = NULL;
+			for (int baseline_index = 0; baseline_index < baseline_count; baseline_index++)
+			{
+				if (strcmp(baseline[baseline_index].name, result->name) == 0)
+				{
+					baseline_entry = &baseline[baseline_index];
+				}
+			}
+
+			if (baseline_entry != NULL && baseline_entry->median_ns > 0.0)
+			{
+				double change = result->median_ns / baseline_entry->median_ns - 1.0;
+
+				// A slowdown has to clear both the tolerance and this run's own noise.
+				bool regressed = change > tolerance && result->median_ns - baseline_entry->median_ns > 3.0 * result->mad_ns;
+				if (regressed)
+				{
+					regression_count++;
+				}
+
+				printf(" %12.1f %+7.1f%%%s\n", baseline_entry->median_ns, change * 100.0, regressed ? "  REGRESSED" : "");
+			}
+			else
+			{
+				printf(" %12s %8s\n", "-", "-");
+			}
+		}
+	}
+
+	int exit_code = 0;
+
+	if (should_write_baseline)
+	{
+		if (write_baseline(baseline_path, results, result_count))
+		{
+			blog(LOG_INFO, "ntr-bench: Wrote baseline to %s", baseline_path);
+		}
+		else
+		{
+			blog(LOG_ERROR, "ntr-bench: Unable to write baseline to %s", baseline_path);
+			exit_code = 1;
+		}
+	}
+	else if (regression_count > 0)
+	{
+		blog(LOG_ERROR, "ntr-bench: %d benchmark(s) regressed by more than %.0f%%", regression_count, tolerance * 100.0);
+		exit_code = 1;
+	}
+
+	obs_ntr_connection_free(context.connection_data);
+	tjDestroy(context.decompressor_handle);
+	bfree(context.image_data);
+	bfree(context.tick_image_data);
+	for (int slot_index = 0; slot_index < CONCURRENT_FRAMES; slot_index++)
+	{
+		bfree(context.slots[slot_index].frame_data);
+	}
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		tjFree(context.frames[screen_index].frame_data);
+	}
+
+	return exit_code;
+}
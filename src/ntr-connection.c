@@ -0,0 +1,1430 @@
+#include "ntr-connection.h"
+#include "ntr-trace.h"
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+
+#include <assert.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include <WinSock2.h>
+
+const int SCREEN_WIDTH[SCREEN_COUNT] =
+{
+	320, 
+	400
+};
+
+const int SCREEN_HEIGHT[SCREEN_COUNT] =
+{
+	240,
+	240
+};
+
+bool obs_ntr_send_remoteview_startup(const struct ntr_connection_setup *setup)
+{
+	struct sockaddr_in client_address;
+	client_address.sin_family = AF_INET;
+	client_address.sin_addr.s_addr = htons(INADDR_ANY);
+	client_address.sin_port = 0;
+
+	struct sockaddr_in server_address;
+	server_address.sin_family = AF_INET;
+	server_address.sin_addr.s_addr = inet_addr(setup->ip_address.array);
+	server_address.sin_port = htons(8000);
+
+
+	SOCKET command_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (command_socket == INVALID_SOCKET)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed to create socket to send startup command to NTR");
+		goto exception;
+	}
+
+	if (bind(command_socket, (struct sockaddr *)&client_address, sizeof(struct sockaddr_in)) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed to bind socket to send startup command to NTR");
+		goto exception;
+	}
+
+	if (connect(command_socket, (struct sockaddr *)&server_address, sizeof(struct sockaddr_in)) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed to connect to %s to send startup command to NTR", setup->ip_address.array);
+		goto exception;
+	}
+
+	struct ntr_command_packet start_command;
+	start_command.magic_number = 0x12345678;
+	start_command.sequence = 1;
+	start_command.type = NS_TYPE_NORMAL;
+	start_command.command = NS_CMD_REMOTEPLAY;
+	start_command.args[0] = (setup->priority_screen << 8) | setup->priority_factor;
+	start_command.args[1] = setup->quality;
+	start_command.args[2] = setup->qos * 1024 * 1024 / 8;
+
+	if (send(command_socket, (const char *)&start_command, sizeof(struct ntr_command_packet), 0) < 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed sending startup command to NTR");
+		goto exception;
+	}
+
+	// The original NTRViewer sends three heartbeats after starting up remoteview for some reason. 
+	// Probably this is used to verify that the NTR service on the 3DS didn't crash on boot or something?
+	// In any case, NTR will not send any data packets back until we do this. 
+	os_sleep_ms(100);
+
+	struct ntr_command_packet heartbeat_command;
+	heartbeat_command.magic_number = 0x12345678;
+	heartbeat_command.type = NS_TYPE_NORMAL;
+	heartbeat_command.command = NS_CMD_HEARTBEAT;
+	for (int ping_index = 0; ping_index < 3; ping_index++)
+	{
+		heartbeat_command.sequence = ping_index + 2;
+		if (send(command_socket, (const char *)&heartbeat_command, sizeof(struct ntr_command_packet), 0) < 0)
+		{
+			blog(LOG_WARNING, "obs-ntr: Failed sending initial heartbeat to NTR");
+			goto exception;
+		}
+
+		os_sleep_ms(100);
+	}
+
+	closesocket(command_socket);
+
+	blog(LOG_WARNING, "obs-ntr: Startup command sent successfully to NTR");
+
+	return true;
+
+exception:
+
+	if (command_socket != INVALID_SOCKET)
+	{
+		closesocket(command_socket);
+	}
+	return false;
+}
+
+unsigned char *obs_ntr_publish_frame(struct ntr_connection_data *connection_data, enum ntr_screen screen, unsigned char id,
+	unsigned char *image_data)
+{
+	pthread_mutex_lock(&connection_data->buffer_mutex[screen]);
+	if (connection_data->keep_latest_frame)
+	{
+		memcpy(connection_data->uncompressed_buffer[screen], image_data, SCREEN_WIDTH[screen] * SCREEN_HEIGHT[screen] * 4);
+	}
+	connection_data->last_frame_id[screen] = id;
+	pthread_mutex_unlock(&connection_data->buffer_mutex[screen]);
+
+	if (connection_data->frame_decoded != NULL)
+	{
+		return connection_data->frame_decoded(connection_data->callback_param, screen, image_data);
+	}
+
+	return image_data;
+}
+
+int obs_ntr_copy_latest_frame(struct ntr_connection_data *connection_data, enum ntr_screen screen, unsigned char *image_data)
+{
+	pthread_mutex_lock(&connection_data->buffer_mutex[screen]);
+	int frame_id = connection_data->last_frame_id[screen];
+	memcpy(image_data, connection_data->uncompressed_buffer[screen], SCREEN_WIDTH[screen] * SCREEN_HEIGHT[screen] * 4);
+	pthread_mutex_unlock(&connection_data->buffer_mutex[screen]);
+
+	return frame_id;
+}
+
+struct ntr_frame_data *obs_ntr_find_frame_slot(struct ntr_frame_data *frames, int frame_count, const struct ntr_data_packet *packet)
+{
+	struct ntr_frame_data *oldest_frame = &frames[0];
+
+	for (int frame_index = 0; frame_index < frame_count; frame_index++)
+	{
+		if (frames[frame_index].id == packet->id && frames[frame_index].is_top == packet->is_top)
+		{
+			return &frames[frame_index];
+		}
+
+		if (frames[frame_index].time_started < oldest_frame->time_started)
+		{
+			oldest_frame = &frames[frame_index];
+		}
+	}
+
+	return oldest_frame;
+}
+
+void obs_ntr_store_packet(struct ntr_frame_data *frame, const struct ntr_data_packet *packet, int packet_size)
+{
+	if (packet->is_last)
+	{
+		frame->expected_packet_count = packet->order + 1;
+		frame->last_packet_data_size = packet_size - 4;
+
+		memcpy(frame->frame_data + (DATA_PACKET_DATA_SIZE * packet->order), packet->data, frame->last_packet_data_size);
+	}
+	else
+	{
+		memcpy(frame->frame_data + (DATA_PACKET_DATA_SIZE * packet->order), packet->data, DATA_PACKET_DATA_SIZE);
+	}
+
+	frame->packet_count++;
+}
+
+// Decodes one complete frame to RGBA. Note that frames from NTR are rotated; the image is
+// SCREEN_HEIGHT pixels wide and SCREEN_WIDTH pixels tall.
+bool obs_ntr_decode_image(tjhandle decompressor_handle, enum ntr_screen screen,
+	const unsigned char *frame_data, int frame_size, unsigned char *image_data)
+{
+	int decompress_result = tjDecompress2(decompressor_handle, frame_data, frame_size,
+		image_data, SCREEN_HEIGHT[screen], SCREEN_HEIGHT[screen] * 4,
+		SCREEN_WIDTH[screen], TJPF_RGBA, 0);
+
+	return decompress_result == 0;
+}
+
+static void obs_ntr_decode_frame(struct ntr_connection_data *connection_data, tjhandle decompressor_handle,
+	enum ntr_screen screen, unsigned char id, unsigned char *frame_data, int frame_size)
+{
+	obs_ntr_decode_image(decompressor_handle, screen, frame_data, frame_size, connection_data->decode_buffer[screen]);
+
+	connection_data->decode_buffer[screen] = obs_ntr_publish_frame(connection_data, screen, id, connection_data->decode_buffer[screen]);
+}
+
+void obs_ntr_replay_buffer_init(struct ntr_replay_buffer *buffer, struct ntr_screen_stats *stats)
+{
+	memset(buffer, 0, sizeof(struct ntr_replay_buffer));
+	pthread_mutex_init_value(&buffer->mutex);
+	pthread_mutex_init(&buffer->mutex, NULL);
+	buffer->stats = stats;
+}
+
+static void obs_ntr_replay_buffer_update_stats(struct ntr_replay_buffer *buffer)
+{
+	os_atomic_set_long(&buffer->stats->replay_frames, (long)buffer->frame_count);
+	os_atomic_set_long(&buffer->stats->replay_kb, (long)(buffer->memory_used / 1024));
+	os_atomic_set_long(&buffer->stats->replay_reserved_kb,
+		(long)((buffer->data_capacity + buffer->frame_capacity * sizeof(struct ntr_replay_frame)) / 1024));
+}
+
+// Must be called with the buffer's mutex held, and not while a frame is being written.
+static void obs_ntr_replay_buffer_resize(struct ntr_replay_buffer *buffer, int seconds)
+{
+	bfree(buffer->frames);
+	bfree(buffer->data);
+
+	buffer->frames = NULL;
+	buffer->data = NULL;
+	buffer->frame_capacity = 0;
+	buffer->data_capacity = 0;
+
+	if (seconds > 0)
+	{
+		buffer->frame_capacity = (size_t)seconds * REPLAY_MAX_FPS;
+		buffer->data_capacity = (size_t)seconds * REPLAY_BYTES_PER_SECOND;
+		buffer->frames = bmalloc(buffer->frame_capacity * sizeof(struct ntr_replay_frame));
+		buffer->data = bmalloc(buffer->data_capacity);
+	}
+
+	buffer->first_frame = 0;
+	buffer->frame_count = 0;
+	buffer->memory_used = 0;
+	buffer->seconds = seconds;
+	buffer->pending_seconds = seconds;
+	buffer->duration_ns = (uint64_t)seconds * 1000000000ULL;
+
+	obs_ntr_replay_buffer_update_stats(buffer);
+}
+
+void obs_ntr_replay_buffer_free(struct ntr_replay_buffer *buffer)
+{
+	bfree(buffer->frames);
+	bfree(buffer->data);
+	pthread_mutex_destroy(&buffer->mutex);
+}
+
+void obs_ntr_replay_buffer_set_duration(struct ntr_replay_buffer *buffer, int seconds)
+{
+	pthread_mutex_lock(&buffer->mutex);
+
+	if (buffer->writing)
+	{
+		buffer->pending_seconds = seconds;
+	}
+	else if (seconds != buffer->seconds)
+	{
+		obs_ntr_replay_buffer_resize(buffer, seconds);
+	}
+
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+struct ntr_replay_frame *obs_ntr_replay_buffer_get(struct ntr_replay_buffer *buffer, long frame_index)
+{
+	return &buffer->frames[(buffer->first_frame + frame_index) % buffer->frame_capacity];
+}
+
+static void obs_ntr_replay_buffer_push(struct ntr_replay_buffer *buffer, const unsigned char *frame_data, int frame_size)
+{
+	uint64_t timestamp = os_gettime_ns();
+
+	pthread_mutex_lock(&buffer->mutex);
+
+	if (buffer->seconds == 0 || (size_t)frame_size > buffer->data_capacity)
+	{
+		pthread_mutex_unlock(&buffer->mutex);
+		return;
+	}
+
+	// The new frame goes right after the newest one, or back at the start if it won't fit there.
+	// Make room by dropping the oldest frames until none of them are in the way, none are too old,
+	// and there's a free slot.
+	size_t write_offset = 0;
+	if (buffer->frame_count > 0)
+	{
+		struct ntr_replay_frame *newest_frame = obs_ntr_replay_buffer_get(buffer, (long)buffer->frame_count - 1);
+		write_offset = newest_frame->offset + newest_frame->size;
+	}
+
+	bool wrap = write_offset + frame_size > buffer->data_capacity;
+
+	while (buffer->frame_count > 0)
+	{
+		struct ntr_replay_frame *oldest_frame = obs_ntr_replay_buffer_get(buffer, 0);
+
+		bool in_the_way = wrap ?
+			oldest_frame->offset >= write_offset || oldest_frame->offset < (size_t)frame_size :
+			oldest_frame->offset >= write_offset && oldest_frame->offset < write_offset + frame_size;
+
+		if (!in_the_way && timestamp - oldest_frame->timestamp <= buffer->duration_ns && buffer->frame_count < buffer->frame_capacity)
+		{
+			break;
+		}
+
+		buffer->memory_used -= oldest_frame->size;
+		buffer->first_frame = (buffer->first_frame + 1) % buffer->frame_capacity;
+		buffer->frame_count--;
+	}
+
+	if (wrap)
+	{
+		write_offset = 0;
+	}
+
+	// Nothing readers can see refers to the space being written now, so the copy doesn't need to
+	// hold up the replay source.
+	buffer->writing = true;
+	pthread_mutex_unlock(&buffer->mutex);
+
+	memcpy(buffer->data + write_offset, frame_data, frame_size);
+
+	pthread_mutex_lock(&buffer->mutex);
+	buffer->writing = false;
+
+	struct ntr_replay_frame *frame = obs_ntr_replay_buffer_get(buffer, (long)buffer->frame_count);
+	frame->timestamp = timestamp;
+	frame->size = frame_size;
+	frame->offset = write_offset;
+
+	buffer->frame_count++;
+	buffer->memory_used += frame_size;
+
+	if (buffer->pending_seconds != buffer->seconds)
+	{
+		obs_ntr_replay_buffer_resize(buffer, buffer->pending_seconds);
+	}
+	else
+	{
+		obs_ntr_replay_buffer_update_stats(buffer);
+	}
+
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+// Must be called with the buffer's mutex held. Returns the index of the newest frame with a timestamp
+// no later than the one given, or -1 if there isn't one.
+long obs_ntr_replay_buffer_find(struct ntr_replay_buffer *buffer, uint64_t timestamp)
+{
+	long low = 0;
+	long high = (long)buffer->frame_count - 1;
+	long found = -1;
+
+	while (low <= high)
+	{
+		long middle = (low + high) / 2;
+		if (obs_ntr_replay_buffer_get(buffer, middle)->timestamp <= timestamp)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+
+	return found;
+}
+
+// Decodes a frame progressively while its packets are still arriving, using libjpeg's suspending
+// data source support. Only the contiguous prefix of the frame that has been received so far is
+// exposed to libjpeg; when it runs out, it suspends and picks back up when the next packet lands.
+// If a packet shows up out of order, the stream gives up and the frame is decoded in full once
+// it's complete, same as usual.
+enum ntr_stream_stage
+{
+	STREAM_READ_HEADER,
+	STREAM_START_DECOMPRESS,
+	STREAM_READ_SCANLINES,
+	STREAM_DONE
+};
+
+struct ntr_stream_decoder
+{
+	struct jpeg_decompress_struct decompress_info;
+	struct jpeg_error_mgr error_manager;
+	struct jpeg_source_mgr source_manager;
+	jmp_buf error_jump;
+
+	enum ntr_screen screen;
+	struct ntr_frame_data *frame;
+	enum ntr_stream_stage stage;
+	int next_order;
+	size_t pending_skip;
+	uint64_t overlapped_ns;
+
+	unsigned char *output;
+};
+
+static void obs_ntr_stream_error_exit(j_common_ptr info)
+{
+	struct ntr_stream_decoder *decoder = info->client_data;
+	longjmp(decoder->error_jump, 1);
+}
+
+static void obs_ntr_stream_output_message(j_common_ptr info)
+{
+	char message[JMSG_LENGTH_MAX];
+	info->err->format_message(info, message);
+	blog(LOG_DEBUG, "obs-ntr: Streaming decode: %s", message);
+}
+
+static void obs_ntr_stream_init_source(j_decompress_ptr info)
+{
+	UNUSED_PARAMETER(info);
+}
+
+static boolean obs_ntr_stream_fill_input_buffer(j_decompress_ptr info)
+{
+	UNUSED_PARAMETER(info);
+
+	// Suspend until the next packet arrives.
+	return FALSE;
+}
+
+static void obs_ntr_stream_skip_input_data(j_decompress_ptr info, long num_bytes)
+{
+	struct ntr_stream_decoder *decoder = info->client_data;
+
+	if (num_bytes <= 0)
+	{
+		return;
+	}
+
+	if ((size_t)num_bytes > info->src->bytes_in_buffer)
+	{
+		decoder->pending_skip += num_bytes - info->src->bytes_in_buffer;
+		info->src->next_input_byte += info->src->bytes_in_buffer;
+		info->src->bytes_in_buffer = 0;
+	}
+	else
+	{
+		info->src->next_input_byte += num_bytes;
+		info->src->bytes_in_buffer -= num_bytes;
+	}
+}
+
+static void obs_ntr_stream_term_source(j_decompress_ptr info)
+{
+	UNUSED_PARAMETER(info);
+}
+
+static void obs_ntr_stream_decoder_init(struct ntr_stream_decoder *decoder, enum ntr_screen screen)
+{
+	memset(decoder, 0, sizeof(struct ntr_stream_decoder));
+
+	decoder->screen = screen;
+	decoder->output = bzalloc(TEMP_BUFFER_SIZE);
+
+	decoder->decompress_info.err = jpeg_std_error(&decoder->error_manager);
+	decoder->error_manager.error_exit = obs_ntr_stream_error_exit;
+	decoder->error_manager.output_message = obs_ntr_stream_output_message;
+	decoder->decompress_info.client_data = decoder;
+
+	jpeg_create_decompress(&decoder->decompress_info);
+
+	decoder->source_manager.init_source = obs_ntr_stream_init_source;
+	decoder->source_manager.fill_input_buffer = obs_ntr_stream_fill_input_buffer;
+	decoder->source_manager.skip_input_data = obs_ntr_stream_skip_input_data;
+	decoder->source_manager.resync_to_restart = jpeg_resync_to_restart;
+	decoder->source_manager.term_source = obs_ntr_stream_term_source;
+	decoder->decompress_info.src = &decoder->source_manager;
+}
+
+static void obs_ntr_stream_decoder_free(struct ntr_stream_decoder *decoder)
+{
+	jpeg_destroy_decompress(&decoder->decompress_info);
+	bfree(decoder->output);
+}
+
+static void obs_ntr_stream_decoder_detach(struct ntr_stream_decoder *decoder)
+{
+	if (decoder->frame != NULL)
+	{
+		jpeg_abort_decompress(&decoder->decompress_info);
+		decoder->frame = NULL;
+	}
+}
+
+static void obs_ntr_stream_decoder_attach(struct ntr_stream_decoder *decoder, struct ntr_frame_data *frame)
+{
+	obs_ntr_stream_decoder_detach(decoder);
+
+	decoder->frame = frame;
+	decoder->stage = STREAM_READ_HEADER;
+	decoder->next_order = 0;
+	decoder->pending_skip = 0;
+	decoder->overlapped_ns = 0;
+	decoder->source_manager.next_input_byte = frame->frame_data;
+	decoder->source_manager.bytes_in_buffer = 0;
+}
+
+// Makes the first available_size bytes of the frame visible to libjpeg. Since the frame data is
+// one contiguous buffer, anything libjpeg hasn't consumed yet is still exactly where it left it.
+static void obs_ntr_stream_decoder_set_available(struct ntr_stream_decoder *decoder, size_t available_size)
+{
+	struct jpeg_source_mgr *source = &decoder->source_manager;
+	const unsigned char *available_end = decoder->frame->frame_data + available_size;
+
+	if (source->next_input_byte + decoder->pending_skip > available_end)
+	{
+		decoder->pending_skip -= available_end - source->next_input_byte;
+		source->next_input_byte = available_end;
+		source->bytes_in_buffer = 0;
+	}
+	else
+	{
+		source->next_input_byte += decoder->pending_skip;
+		source->bytes_in_buffer = available_end - source->next_input_byte;
+		decoder->pending_skip = 0;
+	}
+}
+
+static void obs_ntr_stream_decoder_add_packet(struct ntr_stream_decoder *decoder, struct ntr_frame_data *frame, int order)
+{
+	if (decoder->frame != frame || order < decoder->next_order)
+	{
+		return;
+	}
+
+	if (order > decoder->next_order)
+	{
+		// Out of order; the frame will be decoded in full once it's complete.
+		obs_ntr_stream_decoder_detach(decoder);
+		return;
+	}
+
+	decoder->next_order++;
+
+	if (decoder->next_order == frame->expected_packet_count)
+	{
+		obs_ntr_stream_decoder_set_available(decoder,
+			(frame->expected_packet_count - 1) * DATA_PACKET_DATA_SIZE + frame->last_packet_data_size);
+	}
+	else
+	{
+		obs_ntr_stream_decoder_set_available(decoder, decoder->next_order * DATA_PACKET_DATA_SIZE);
+	}
+}
+
+// Decodes as far as the available data allows. Returns true once the whole image has been decoded.
+// On a decoding error, the decoder is detached from its frame.
+static bool obs_ntr_stream_decoder_advance(struct ntr_stream_decoder *decoder)
+{
+	struct jpeg_decompress_struct *info = &decoder->decompress_info;
+
+	if (decoder->frame == NULL)
+	{
+		return false;
+	}
+
+	if (setjmp(decoder->error_jump))
+	{
+		obs_ntr_stream_decoder_detach(decoder);
+		return false;
+	}
+
+	if (decoder->stage == STREAM_READ_HEADER)
+	{
+		if (jpeg_read_header(info, TRUE) == JPEG_SUSPENDED)
+		{
+			return false;
+		}
+
+		if (info->image_width != SCREEN_HEIGHT[decoder->screen] || info->image_height != SCREEN_WIDTH[decoder->screen])
+		{
+			obs_ntr_stream_decoder_detach(decoder);
+			return false;
+		}
+
+		info->out_color_space = JCS_EXT_RGBA;
+		decoder->stage = STREAM_START_DECOMPRESS;
+	}
+
+	if (decoder->stage == STREAM_START_DECOMPRESS)
+	{
+		if (!jpeg_start_decompress(info))
+		{
+			return false;
+		}
+
+		decoder->stage = STREAM_READ_SCANLINES;
+	}
+
+	if (decoder->stage == STREAM_READ_SCANLINES)
+	{
+		JSAMPROW rows[16];
+
+		while (info->output_scanline < info->output_height)
+		{
+			int row_count = 0;
+			while (row_count < 16 && info->output_scanline + row_count < info->output_height)
+			{
+				rows[row_count] = decoder->output + (info->output_scanline + row_count) * info->output_width * 4;
+				row_count++;
+			}
+
+			if (jpeg_read_scanlines(info, rows, row_count) == 0)
+			{
+				return false;
+			}
+		}
+
+		decoder->stage = STREAM_DONE;
+	}
+
+	return decoder->stage == STREAM_DONE;
+}
+
+// Per-screen counters kept by the network thread between stats publications.
+struct ntr_screen_counters
+{
+	long packets_received;
+	long packets_duplicated;
+	long packets_reordered;
+	long packets_lost;
+	long frames_completed;
+	long frames_dropped;
+
+	int interval_frames;
+	int interval_started_frames;
+	uint64_t interval_bytes;
+	int interval_decoded_frames;
+	uint64_t interval_decode_ns;
+	int interval_streamed_frames;
+	uint64_t interval_overlapped_decode_ns;
+
+	uint64_t last_frame_time;
+
+	// The window behind the per-screen stats in the connection data.
+	int window_frames_processed;
+	int window_frames_dropped;
+	int window_frames_decoded;
+	int window_frames_streamed;
+	uint64_t window_decode_ns;
+	uint64_t window_overlapped_decode_ns;
+	uint64_t window_start_time;
+};
+
+// The reassembly slots currently set aside for one screen, and how many it should have.
+struct ntr_frame_partition
+{
+	struct ntr_frame_data *frames;
+	int frame_count;
+	int target_frame_count;
+};
+
+static void obs_ntr_add_frame_graph_sample(struct ntr_frame_graph *graph, struct ntr_screen_counters *counters,
+	uint64_t frame_started_time, bool dropped)
+{
+	uint64_t now = os_gettime_ns();
+	long sample_count = graph->sample_count;
+	struct ntr_frame_graph_sample *sample = &graph->samples[sample_count % FRAME_GRAPH_SAMPLE_COUNT];
+
+	sample->interval_ms = counters->last_frame_time > 0 ? (now - counters->last_frame_time) / 1000000.0f : 0.0f;
+	sample->latency_ms = dropped ? 0.0f : (now - frame_started_time) / 1000000.0f;
+	sample->dropped = dropped;
+
+	os_atomic_set_long(&graph->sample_count, sample_count + 1);
+
+	if (!dropped)
+	{
+		counters->last_frame_time = now;
+	}
+}
+
+// Clears the published stats for a new connection. They may be read at any time, so each field is
+// set on its own rather than wiping the whole struct. The replay counts describe the replay buffers,
+// which outlive the connection, so they're left as they are.
+static void obs_ntr_reset_stats(struct ntr_stats *stats)
+{
+	os_atomic_set_long(&stats->connected, 0);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		struct ntr_screen_stats *screen_stats = &stats->screens[screen_index];
+
+		os_atomic_set_long(&screen_stats->packets_received, 0);
+		os_atomic_set_long(&screen_stats->packets_duplicated, 0);
+		os_atomic_set_long(&screen_stats->packets_reordered, 0);
+		os_atomic_set_long(&screen_stats->packets_lost, 0);
+		os_atomic_set_long(&screen_stats->frames_completed, 0);
+		os_atomic_set_long(&screen_stats->frames_dropped, 0);
+		os_atomic_set_long(&screen_stats->receive_slots, 0);
+		os_atomic_set_long(&screen_stats->fps_x100, 0);
+		os_atomic_set_long(&screen_stats->kbps, 0);
+		os_atomic_set_long(&screen_stats->decode_us, 0);
+		os_atomic_set_long(&screen_stats->overlapped_decode_us, 0);
+
+		os_atomic_set_long(&stats->frame_graphs[screen_index].sample_count, 0);
+	}
+}
+
+static void obs_ntr_publish_stats(struct ntr_stats *stats, struct ntr_screen_counters *counters, uint64_t elapsed_ns)
+{
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		struct ntr_screen_stats *screen_stats = &stats->screens[screen_index];
+		struct ntr_screen_counters *screen_counters = &counters[screen_index];
+
+		os_atomic_set_long(&screen_stats->packets_received, screen_counters->packets_received);
+		os_atomic_set_long(&screen_stats->packets_duplicated, screen_counters->packets_duplicated);
+		os_atomic_set_long(&screen_stats->packets_reordered, screen_counters->packets_reordered);
+		os_atomic_set_long(&screen_stats->packets_lost, screen_counters->packets_lost);
+		os_atomic_set_long(&screen_stats->frames_completed, screen_counters->frames_completed);
+		os_atomic_set_long(&screen_stats->frames_dropped, screen_counters->frames_dropped);
+
+		os_atomic_set_long(&screen_stats->fps_x100, (long)(screen_counters->interval_frames * 100000000000ULL / elapsed_ns));
+		os_atomic_set_long(&screen_stats->kbps, (long)(screen_counters->interval_bytes * 8000000ULL / elapsed_ns));
+		os_atomic_set_long(&screen_stats->decode_us, screen_counters->interval_decoded_frames > 0 ?
+			(long)(screen_counters->interval_decode_ns / screen_counters->interval_decoded_frames / 1000) : 0);
+		os_atomic_set_long(&screen_stats->overlapped_decode_us, screen_counters->interval_streamed_frames > 0 ?
+			(long)(screen_counters->interval_overlapped_decode_ns / screen_counters->interval_streamed_frames / 1000) : 0);
+
+		screen_counters->interval_frames = 0;
+		screen_counters->interval_bytes = 0;
+		screen_counters->interval_decoded_frames = 0;
+		screen_counters->interval_decode_ns = 0;
+		screen_counters->interval_streamed_frames = 0;
+		screen_counters->interval_overlapped_decode_ns = 0;
+	}
+}
+
+static int obs_ntr_receive_packet(SOCKET data_socket, struct ntr_data_packet *packet)
+{
+	struct sockaddr_in from_address;
+	int from_address_length = sizeof(struct sockaddr_in);
+	return recvfrom(data_socket, (char *)packet, sizeof(struct ntr_data_packet), 0, (struct sockaddr *)&from_address, &from_address_length);
+}
+
+#define SCREEN_STATS_FRAME_COUNT 100
+#define SCREEN_STATS_MAX_DURATION_NS 5000000000ULL
+
+// Updates the per-screen stats in the connection data once a screen has processed enough frames,
+// or after a while regardless, so a screen that's barely getting any frames (or none at all) still
+// shows it.
+static void obs_ntr_update_screen_stats(struct ntr_connection_data *connection_data, enum ntr_screen screen,
+	struct ntr_screen_counters *counters, uint64_t now)
+{
+	if (counters->window_frames_processed < SCREEN_STATS_FRAME_COUNT && now - counters->window_start_time < SCREEN_STATS_MAX_DURATION_NS)
+	{
+		return;
+	}
+
+	float elapsed_seconds = (now - counters->window_start_time) / 1000000000.0f;
+
+	connection_data->dropped_frames[screen] = counters->window_frames_dropped;
+	connection_data->total_processed_frames[screen] = counters->window_frames_processed;
+	connection_data->fps[screen] = (counters->window_frames_processed - counters->window_frames_dropped) / elapsed_seconds;
+	connection_data->decode_ms[screen] = counters->window_frames_decoded > 0 ?
+		(float)counters->window_decode_ns / counters->window_frames_decoded / 1000000.0f : 0.0f;
+	connection_data->overlapped_decode_ms[screen] = counters->window_frames_streamed > 0 ?
+		(float)counters->window_overlapped_decode_ns / counters->window_frames_streamed / 1000000.0f : 0.0f;
+	connection_data->last_stat_time = now;
+
+	counters->window_frames_processed = 0;
+	counters->window_frames_dropped = 0;
+	counters->window_frames_decoded = 0;
+	counters->window_frames_streamed = 0;
+	counters->window_decode_ns = 0;
+	counters->window_overlapped_decode_ns = 0;
+	counters->window_start_time = now;
+}
+
+// Gives up on a frame that's still missing packets, counting it as dropped for its own screen.
+static void obs_ntr_abandon_frame(struct ntr_connection_data *connection_data, struct ntr_frame_data *frame,
+	struct ntr_screen_counters *screen_counters, struct ntr_stream_decoder *stream_decoders)
+{
+	if (!frame->finished && frame->packet_count > 0)
+	{
+		// Packets past the highest one seen can't be counted exactly if the last one never showed up,
+		// so this assumes at least that one is missing.
+		int frame_packet_total = frame->expected_packet_count > 0 ? frame->expected_packet_count : frame->highest_order + 2;
+		struct ntr_screen_counters *counters = &screen_counters[frame->is_top];
+		counters->frames_dropped++;
+		counters->packets_lost += frame_packet_total - frame->packet_count;
+		counters->window_frames_processed++;
+		counters->window_frames_dropped++;
+
+		obs_ntr_add_frame_graph_sample(&connection_data->stats->frame_graphs[frame->is_top], counters, frame->time_started, true);
+	}
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		if (stream_decoders[screen_index].frame == frame)
+		{
+			obs_ntr_stream_decoder_detach(&stream_decoders[screen_index]);
+		}
+	}
+}
+
+void obs_ntr_divide_frame_slots(const double *weights, int *frame_counts)
+{
+	int spare_frames = CONCURRENT_FRAMES - MIN_SCREEN_FRAMES * SCREEN_COUNT;
+
+	double total_weight = 0.0;
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		total_weight += weights[screen_index] > 0.0 ? weights[screen_index] : 0.0;
+	}
+
+	double remainders[SCREEN_COUNT];
+	int assigned_frames = 0;
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		double weight = weights[screen_index] > 0.0 ? weights[screen_index] : 0.0;
+		double share = total_weight > 0.0 ? spare_frames * weight / total_weight : (double)spare_frames / SCREEN_COUNT;
+
+		frame_counts[screen_index] = MIN_SCREEN_FRAMES + (int)share;
+		remainders[screen_index] = share - (int)share;
+		assigned_frames += (int)share;
+	}
+
+	// Whatever rounding down left over goes to the screens that lost the most to it.
+	for (; assigned_frames < spare_frames; assigned_frames++)
+	{
+		int largest_index = 0;
+		for (int screen_index = 1; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			if (remainders[screen_index] > remainders[largest_index])
+			{
+				largest_index = screen_index;
+			}
+		}
+
+		frame_counts[largest_index]++;
+		remainders[largest_index] = -1.0;
+	}
+}
+
+// How far a screen's ideal share of the slots has to move past the halfway point to another whole
+// slot before its target changes, so that noise in the measured rates doesn't keep moving slots
+// back and forth.
+#define PARTITION_HYSTERESIS_FRAMES 0.25
+
+// Moves one slot from one screen's partition to the other's, if the first has one that isn't
+// holding a frame in progress. Slots are laid out screen by screen, and there are only two screens,
+// so the partitions always meet; a free slot is swapped to where they meet and then changes hands.
+static bool obs_ntr_move_frame_slot(struct ntr_connection_data *connection_data, struct ntr_frame_partition *partitions,
+	enum ntr_screen from_screen, enum ntr_screen to_screen, struct ntr_screen_counters *screen_counters,
+	struct ntr_stream_decoder *stream_decoders)
+{
+	struct ntr_frame_partition *from_partition = &partitions[from_screen];
+	struct ntr_frame_partition *to_partition = &partitions[to_screen];
+
+	// Prefer a slot that's never been used, and then the one whose frame finished longest ago, as
+	// it's the least likely to still get a stray duplicate packet.
+	struct ntr_frame_data *free_frame = NULL;
+	for (int frame_index = 0; frame_index < from_partition->frame_count; frame_index++)
+	{
+		struct ntr_frame_data *frame = &from_partition->frames[frame_index];
+		if ((frame->finished || frame->packet_count == 0) &&
+			(free_frame == NULL || (free_frame->packet_count > 0 && (frame->packet_count == 0 || frame->time_started < free_frame->time_started))))
+		{
+			free_frame = frame;
+		}
+	}
+
+	if (free_frame == NULL)
+	{
+		return false;
+	}
+
+	bool from_is_first = from_partition->frames < to_partition->frames;
+	struct ntr_frame_data *edge_frame = from_is_first ? &from_partition->frames[from_partition->frame_count - 1] : &from_partition->frames[0];
+
+	if (free_frame != edge_frame)
+	{
+		struct ntr_frame_data swap = *free_frame;
+		*free_frame = *edge_frame;
+		*edge_frame = swap;
+
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			if (stream_decoders[screen_index].frame == free_frame)
+			{
+				stream_decoders[screen_index].frame = edge_frame;
+			}
+			else if (stream_decoders[screen_index].frame == edge_frame)
+			{
+				stream_decoders[screen_index].frame = free_frame;
+			}
+		}
+	}
+
+	// Nothing is in progress here, so this only lets go of any stream decode still pointing at it.
+	obs_ntr_abandon_frame(connection_data, edge_frame, screen_counters, stream_decoders);
+
+	// Marked finished, so the first packet for the new screen takes it over.
+	edge_frame->is_top = to_screen;
+	edge_frame->id = 0;
+	edge_frame->packet_count = 0;
+	edge_frame->expected_packet_count = 0;
+	edge_frame->last_packet_data_size = 0;
+	edge_frame->highest_order = -1;
+	edge_frame->received_mask = 0;
+	edge_frame->finished = true;
+	edge_frame->time_started = 0;
+
+	from_partition->frame_count--;
+	if (!from_is_first)
+	{
+		from_partition->frames++;
+	}
+
+	to_partition->frame_count++;
+	if (from_is_first)
+	{
+		to_partition->frames--;
+	}
+
+	return true;
+}
+
+// Divides the slots according to the configured priority, averaged with the share of frames each
+// screen has actually been sending lately once that's known. The target only changes once a
+// screen's share has moved clearly past a slot boundary, and slots only change hands once they
+// aren't holding a frame in progress, so rebalancing never drops a frame.
+static void obs_ntr_partition_frames(struct ntr_connection_data *connection_data, struct ntr_frame_data *frames,
+	struct ntr_frame_partition *partitions, const double *measured_rates, struct ntr_screen_counters *screen_counters,
+	struct ntr_stream_decoder *stream_decoders)
+{
+	double configured_weights[SCREEN_COUNT];
+	double configured_total = 0.0;
+	double measured_total = 0.0;
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		bool is_priority = screen_index == (int)connection_data->priority_screen && connection_data->priority_factor > 0;
+		configured_weights[screen_index] = is_priority ? connection_data->priority_factor : 1.0;
+		configured_total += configured_weights[screen_index];
+		measured_total += measured_rates[screen_index];
+	}
+
+	double weights[SCREEN_COUNT];
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		weights[screen_index] = configured_weights[screen_index] / configured_total;
+		if (measured_total > 0.0)
+		{
+			weights[screen_index] = (weights[screen_index] + measured_rates[screen_index] / measured_total) / 2.0;
+		}
+	}
+
+	int frame_counts[SCREEN_COUNT];
+
+	if (partitions[0].frames == NULL)
+	{
+		// The first division just lays the slots out.
+		obs_ntr_divide_frame_slots(weights, frame_counts);
+
+		int first_frame_index = 0;
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			for (int frame_index = first_frame_index; frame_index < first_frame_index + frame_counts[screen_index]; frame_index++)
+			{
+				frames[frame_index].is_top = screen_index;
+				frames[frame_index].id = 0;
+				frames[frame_index].expected_packet_count = 0;
+				frames[frame_index].last_packet_data_size = 0;
+				frames[frame_index].highest_order = -1;
+				frames[frame_index].received_mask = 0;
+				frames[frame_index].time_started = 0;
+			}
+
+			partitions[screen_index].frames = &frames[first_frame_index];
+			partitions[screen_index].frame_count = frame_counts[screen_index];
+			partitions[screen_index].target_frame_count = frame_counts[screen_index];
+			first_frame_index += frame_counts[screen_index];
+		}
+	}
+	else
+	{
+		// Only aim for a new division once some screen's ideal number of slots is clearly closer to
+		// another whole number than to what it has now.
+		int spare_frames = CONCURRENT_FRAMES - MIN_SCREEN_FRAMES * SCREEN_COUNT;
+		bool retarget = false;
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			double ideal_frame_count = MIN_SCREEN_FRAMES + spare_frames * weights[screen_index];
+			retarget = retarget || fabs(ideal_frame_count - partitions[screen_index].frame_count) > 0.5 + PARTITION_HYSTERESIS_FRAMES;
+		}
+
+		if (retarget)
+		{
+			obs_ntr_divide_frame_slots(weights, frame_counts);
+			for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+			{
+				partitions[screen_index].target_frame_count = frame_counts[screen_index];
+			}
+		}
+
+		// Anything that can't move yet is tried again next time.
+		bool moved = false;
+		while (partitions[SCREEN_TOP].frame_count < partitions[SCREEN_TOP].target_frame_count &&
+			obs_ntr_move_frame_slot(connection_data, partitions, SCREEN_BOTTOM, SCREEN_TOP, screen_counters, stream_decoders))
+		{
+			moved = true;
+		}
+		while (partitions[SCREEN_BOTTOM].frame_count < partitions[SCREEN_BOTTOM].target_frame_count &&
+			obs_ntr_move_frame_slot(connection_data, partitions, SCREEN_TOP, SCREEN_BOTTOM, screen_counters, stream_decoders))
+		{
+			moved = true;
+		}
+
+		if (!moved)
+		{
+			return;
+		}
+	}
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		connection_data->receive_slots[screen_index] = partitions[screen_index].frame_count;
+		os_atomic_set_long(&connection_data->stats->screens[screen_index].receive_slots, partitions[screen_index].frame_count);
+	}
+
+	blog(LOG_DEBUG, "obs-ntr: Reassembly slots divided %d top, %d bottom", partitions[SCREEN_TOP].frame_count, partitions[SCREEN_BOTTOM].frame_count);
+}
+
+#define DATA_SOCKET_TIMEOUT_DURATION_NS 1000000000
+
+// How much each stats interval's frame rate counts towards the smoothed rates the slots are divided
+// by; about the last two seconds' worth matter.
+#define MEASURED_RATE_SMOOTHING 0.25
+
+static void *obs_ntr_net_thread_run(void *data)
+{
+	struct ntr_connection_data *connection_data = data;
+
+	tjhandle decompressor_handle = tjInitDecompress();
+
+	struct ntr_stream_decoder stream_decoders[SCREEN_COUNT];
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		obs_ntr_stream_decoder_init(&stream_decoders[screen_index], screen_index);
+	}
+
+	// The newest completed frame for each screen that was skipped because nobody was showing
+	// that screen. If the screen becomes visible again, this is decoded right away instead of
+	// waiting for the next frame to arrive. 
+	struct ntr_frame_data skipped_frames[SCREEN_COUNT];
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		skipped_frames[screen_index].id = 0;
+		skipped_frames[screen_index].finished = false;
+		skipped_frames[screen_index].frame_data = bzalloc(DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT);
+	}
+
+	// The slots themselves are set up when they're first divided between the screens, below.
+	struct ntr_frame_data frames[CONCURRENT_FRAMES];
+	for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
+	{
+		frames[frame_index].packet_count = 0;
+		frames[frame_index].finished = true;
+		frames[frame_index].frame_data = bzalloc(DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT);
+	}
+
+	struct ntr_frame_partition partitions[SCREEN_COUNT];
+	memset(partitions, 0, sizeof(partitions));
+
+	connection_data->disconnect_requested = false;
+	
+	struct sockaddr_in data_socket_address_data;
+	data_socket_address_data.sin_family = AF_INET;
+	data_socket_address_data.sin_addr.s_addr = htonl(INADDR_ANY);
+	data_socket_address_data.sin_port = htons(8001);
+
+	SOCKET data_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (data_socket == INVALID_SOCKET)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed creating a data socket");
+		goto exception;
+	}
+
+	if (bind(data_socket, (struct sockaddr *)&data_socket_address_data, sizeof(struct sockaddr_in)) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Failed binding a data socket");
+		goto exception;
+	}
+
+	int buffer_size = 8 * 1024 * 1024;
+	struct timeval timeout;
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	if (setsockopt(data_socket, SOL_SOCKET, SO_RCVBUF, (char *)&buffer_size, sizeof(int)) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Unable to set buffer size on data socket");
+	}
+
+	if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(struct timeval)) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: Unable to set timeout on data socket");
+	}
+
+	struct ntr_screen_counters screen_counters[SCREEN_COUNT];
+	memset(screen_counters, 0, sizeof(screen_counters));
+	uint64_t last_stats_publish_time = os_gettime_ns();
+
+	obs_ntr_reset_stats(connection_data->stats);
+	os_atomic_set_long(&connection_data->stats->connected, 1);
+
+	// Frames started per second on each screen, smoothed over the last few seconds.
+	double measured_rates[SCREEN_COUNT] = { 0.0 };
+	obs_ntr_partition_frames(connection_data, frames, partitions, measured_rates, screen_counters, stream_decoders);
+
+	uint64_t last_read_time = os_gettime_ns();
+
+	connection_data->last_stat_time = last_read_time;
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		screen_counters[screen_index].window_start_time = last_read_time;
+	}
+
+	while (!connection_data->disconnect_requested)
+	{
+		uint64_t stats_now = os_gettime_ns();
+
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			obs_ntr_update_screen_stats(connection_data, screen_index, &screen_counters[screen_index], stats_now);
+		}
+
+		if (stats_now - last_stats_publish_time >= STATS_INTERVAL_NS)
+		{
+			double elapsed_seconds = (stats_now - last_stats_publish_time) / 1000000000.0;
+			for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+			{
+				double interval_rate = screen_counters[screen_index].interval_started_frames / elapsed_seconds;
+				measured_rates[screen_index] = measured_rates[screen_index] > 0.0 ?
+					measured_rates[screen_index] + (interval_rate - measured_rates[screen_index]) * MEASURED_RATE_SMOOTHING : interval_rate;
+				screen_counters[screen_index].interval_started_frames = 0;
+			}
+			obs_ntr_partition_frames(connection_data, frames, partitions, measured_rates, screen_counters, stream_decoders);
+
+			obs_ntr_publish_stats(connection_data->stats, screen_counters, stats_now - last_stats_publish_time);
+			last_stats_publish_time = stats_now;
+		}
+
+		struct ntr_data_packet packet;
+		int receive_result = obs_ntr_receive_packet(data_socket, &packet);
+
+		if (receive_result > 0 && connection_data->trace_file != NULL)
+		{
+			obs_ntr_trace_write_packet(connection_data->trace_file, os_gettime_ns(), &packet, receive_result);
+		}
+
+		if (receive_result > 0 && packet.order >= DATA_PACKET_MAX_COUNT)
+		{
+			blog(LOG_DEBUG, "obs-ntr: Ignoring packet %d of frame %d; too many packets in frame", packet.order, packet.id);
+		}
+		else if (receive_result > 0)
+		{
+			struct ntr_frame_data *active_frame = NULL;
+
+			//blog(LOG_DEBUG, "obs-ntr: Received packet %d of frame id %d(%d)", packet.order, packet.id, packet.is_top);
+			//blog(LOG_DEBUG, "obs-ntr: Current frames: %d(%d) %d(%d) %d(%d) %d(%d)", connection_data->frames[0].id, connection_data->frames[0].is_top,
+				//connection_data->frames[1].id, connection_data->frames[1].is_top, connection_data->frames[2].id, connection_data->frames[2].is_top,
+				//connection_data->frames[3].id, connection_data->frames[3].is_top);
+
+			last_read_time = os_gettime_ns();
+
+			// Only this screen's own slots are searched, or given up for a new frame.
+			struct ntr_frame_partition *partition = &partitions[packet.is_top];
+			active_frame = obs_ntr_find_frame_slot(partition->frames, partition->frame_count, &packet);
+
+			assert(active_frame != NULL);
+
+			struct ntr_screen_counters *counters = &screen_counters[packet.is_top];
+			counters->packets_received++;
+			counters->interval_bytes += receive_result;
+
+			bool is_same_frame = active_frame->id == packet.id && active_frame->is_top == packet.is_top;
+			uint64_t packet_bit = 1ULL << packet.order;
+
+			if (is_same_frame && (active_frame->received_mask & packet_bit) != 0)
+			{
+				counters->packets_duplicated++;
+				goto packet_done;
+			}
+
+			if (!is_same_frame || active_frame->finished)
+			{
+				obs_ntr_abandon_frame(connection_data, active_frame, screen_counters, stream_decoders);
+				counters->interval_started_frames++;
+
+				active_frame->is_top = packet.is_top;
+				active_frame->id = packet.id;
+				active_frame->expected_packet_count = 0;
+				active_frame->packet_count = 0;
+				active_frame->last_packet_data_size = 0;
+				active_frame->highest_order = -1;
+				active_frame->received_mask = 0;
+				active_frame->finished = false;
+				active_frame->time_started = os_gettime_ns();
+			}
+
+			if (packet.order < active_frame->highest_order)
+			{
+				counters->packets_reordered++;
+			}
+			else
+			{
+				active_frame->highest_order = packet.order;
+			}
+			active_frame->received_mask |= packet_bit;
+
+			struct ntr_stream_decoder *stream_decoder = &stream_decoders[packet.is_top];
+
+			if (connection_data->stream_decode && active_frame->packet_count == 0 && packet.order == 0 &&
+				os_atomic_load_long(&connection_data->decode_demand[packet.is_top]) > 0)
+			{
+				obs_ntr_stream_decoder_attach(stream_decoder, active_frame);
+			}
+
+			obs_ntr_store_packet(active_frame, &packet, receive_result);
+
+			obs_ntr_stream_decoder_add_packet(stream_decoder, active_frame, packet.order);
+
+			bool frame_complete = active_frame->expected_packet_count > 0 && active_frame->packet_count >= active_frame->expected_packet_count;
+
+			if (!frame_complete && stream_decoder->frame == active_frame)
+			{
+				// Whatever gets decoded now is work that would otherwise happen after the last packet.
+				uint64_t advance_start_time = os_gettime_ns();
+				obs_ntr_stream_decoder_advance(stream_decoder);
+				stream_decoder->overlapped_ns += os_gettime_ns() - advance_start_time;
+			}
+
+			//blog(LOG_DEBUG, "obs-ntr: Frame %d now has %d/%d packets", active_frame->id, active_frame->packet_count, active_frame->expected_packet_count);
+
+			if (frame_complete)
+			{
+				//blog(LOG_DEBUG, "obs-ntr: Finishing frame %d with %d/%d packets", active_frame->id, active_frame->packet_count, active_frame->expected_packet_count);
+
+				active_frame->finished = true;
+				counters->window_frames_processed++;
+
+				counters->frames_completed++;
+				counters->interval_frames++;
+
+				int frame_size = (active_frame->expected_packet_count - 1) * DATA_PACKET_DATA_SIZE + active_frame->last_packet_data_size;
+
+				if (connection_data->replay_buffers != NULL)
+				{
+					obs_ntr_replay_buffer_push(&connection_data->replay_buffers[packet.is_top], active_frame->frame_data, frame_size);
+				}
+
+				if (connection_data->frame_received != NULL && os_atomic_load_long(&connection_data->compressed_demand[packet.is_top]) > 0)
+				{
+					connection_data->frame_received(connection_data->callback_param, packet.is_top, active_frame->frame_data, frame_size);
+				}
+
+				if (os_atomic_load_long(&connection_data->decode_demand[packet.is_top]) > 0)
+				{
+					uint64_t decode_start_time = os_gettime_ns();
+
+					bool streamed = false;
+					if (stream_decoder->frame == active_frame)
+					{
+						// Packets may have been reordered, so hand over the whole frame regardless.
+						obs_ntr_stream_decoder_set_available(stream_decoder, frame_size);
+						streamed = obs_ntr_stream_decoder_advance(stream_decoder);
+					}
+
+					if (streamed)
+					{
+						stream_decoder->output = obs_ntr_publish_frame(connection_data, packet.is_top, packet.id, stream_decoder->output);
+						obs_ntr_stream_decoder_detach(stream_decoder);
+
+						counters->window_overlapped_decode_ns += stream_decoder->overlapped_ns;
+						counters->window_frames_streamed++;
+						counters->interval_overlapped_decode_ns += stream_decoder->overlapped_ns;
+						counters->interval_streamed_frames++;
+					}
+					else
+					{
+						if (stream_decoder->frame == active_frame)
+						{
+							obs_ntr_stream_decoder_detach(stream_decoder);
+						}
+
+						obs_ntr_decode_frame(connection_data, decompressor_handle, packet.is_top, packet.id, active_frame->frame_data, frame_size);
+					}
+
+					uint64_t frame_decode_ns = os_gettime_ns() - decode_start_time;
+					counters->window_decode_ns += frame_decode_ns;
+					counters->window_frames_decoded++;
+					counters->interval_decode_ns += frame_decode_ns;
+					counters->interval_decoded_frames++;
+					skipped_frames[packet.is_top].finished = false;
+				}
+				else
+				{
+					if (stream_decoder->frame == active_frame)
+					{
+						obs_ntr_stream_decoder_detach(stream_decoder);
+					}
+
+					// Nobody is looking at this screen, so just hang on to the compressed data. Swapping
+					// buffers with the frame slot avoids copying it. 
+					unsigned char *skipped_frame_data = skipped_frames[packet.is_top].frame_data;
+					skipped_frames[packet.is_top].frame_data = active_frame->frame_data;
+					skipped_frames[packet.is_top].id = packet.id;
+					skipped_frames[packet.is_top].last_packet_data_size = frame_size;
+					skipped_frames[packet.is_top].finished = true;
+					active_frame->frame_data = skipped_frame_data;
+				}
+
+				obs_ntr_add_frame_graph_sample(&connection_data->stats->frame_graphs[packet.is_top], counters,
+					active_frame->time_started, false);
+			}
+		}
+		else
+		{
+			uint64_t elapsed_ns_since_last_read = os_gettime_ns() - last_read_time;
+
+			if (elapsed_ns_since_last_read >= DATA_SOCKET_TIMEOUT_DURATION_NS)
+			{
+				blog(LOG_WARNING, "obs-ntr: Data socket received no data after %d ms; probably not active", elapsed_ns_since_last_read / 1000000);
+				break;
+			}
+		}
+
+packet_done:
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			struct ntr_frame_data *skipped_frame = &skipped_frames[screen_index];
+			if (skipped_frame->finished && os_atomic_load_long(&connection_data->decode_demand[screen_index]) > 0)
+			{
+				// The total size of the skipped frame is stashed in last_packet_data_size.
+				obs_ntr_decode_frame(connection_data, decompressor_handle, screen_index, skipped_frame->id,
+					skipped_frame->frame_data, skipped_frame->last_packet_data_size);
+				skipped_frame->finished = false;
+			}
+		}
+
+		// It seems to be critical to our packet loss rate to wait for a non-zero duration here,
+		// probably so the OS has adequate time to populate the socket's buffer. Note that I'm
+		// passing 2, because the Windows implementation reduces the value by 1 for some reason. 
+		os_sleep_ms(2);
+	}
+
+	obs_ntr_publish_stats(connection_data->stats, screen_counters, os_gettime_ns() - last_stats_publish_time);
+	os_atomic_set_long(&connection_data->stats->connected, 0);
+
+	for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
+	{
+		bfree(frames[frame_index].frame_data);
+	}
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		bfree(skipped_frames[screen_index].frame_data);
+		obs_ntr_stream_decoder_free(&stream_decoders[screen_index]);
+	}
+
+	tjDestroy(decompressor_handle);
+
+	closesocket(data_socket);
+	connection_data->net_thread_exited = true;
+
+	return 0;
+
+exception:
+	if (data_socket != INVALID_SOCKET)
+	{
+		closesocket(data_socket);
+	}
+
+	connection_data->net_thread_exited = true;
+	return (void *)1;
+}
+
+struct ntr_connection_data *obs_ntr_connection_alloc(void)
+{
+	struct ntr_connection_data *connection_data = bzalloc(sizeof(struct ntr_connection_data));
+	connection_data->keep_latest_frame = true;
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		connection_data->uncompressed_buffer[screen_index] = bzalloc(SCREEN_WIDTH[screen_index] * SCREEN_HEIGHT[screen_index] * 4);
+		connection_data->decode_buffer[screen_index] = bzalloc(TEMP_BUFFER_SIZE);
+
+		pthread_mutex_init_value(&connection_data->buffer_mutex[screen_index]);
+		pthread_mutex_init(&connection_data->buffer_mutex[screen_index], NULL);
+	}
+
+	return connection_data;
+}
+
+void obs_ntr_connection_start(struct ntr_connection_data *connection_data)
+{
+	connection_data->net_thread_exited = false;
+	connection_data->net_thread_started = true;
+	pthread_create(&connection_data->net_thread, NULL, obs_ntr_net_thread_run, connection_data);
+}
+
+void obs_ntr_connection_free(struct ntr_connection_data *connection_data)
+{
+	if (connection_data->net_thread_started)
+	{
+		connection_data->disconnect_requested = true;
+		pthread_join(connection_data->net_thread, NULL);
+	}
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		pthread_mutex_destroy(&connection_data->buffer_mutex[screen_index]);
+		bfree(connection_data->uncompressed_buffer[screen_index]);
+		bfree(connection_data->decode_buffer[screen_index]);
+	}
+
+	bfree(connection_data);
+}
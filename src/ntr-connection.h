@@ -0,0 +1,302 @@
+#pragma once
+
+#include <util/c99defs.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/threading.h>
+
+#include <turbojpeg.h>
+
+#include <stdio.h>
+
+// The NTR protocol, receiving, and decoding, independent of any OBS sources so it can also be
+// used by the command line tools.
+
+// Extracted from ns.h in the NTR source.
+enum ntr_command_type
+{
+	NS_TYPE_NORMAL,
+	NS_TYPE_BIGDATA
+};
+
+enum ntr_command
+{
+	NS_CMD_HEARTBEAT = 0,
+	NS_CMD_REMOTEPLAY = 901
+};
+
+
+enum ntr_screen
+{
+	SCREEN_BOTTOM,
+	SCREEN_TOP,
+
+	SCREEN_COUNT
+};
+
+extern const int SCREEN_WIDTH[SCREEN_COUNT];
+extern const int SCREEN_HEIGHT[SCREEN_COUNT];
+
+#define TEMP_BUFFER_SIZE (320 * 400 * 4)
+
+struct ntr_command_packet
+{
+	int magic_number;
+	int sequence;
+	enum ntr_command_type type;
+	enum ntr_command command;
+	int args[4];
+
+	unsigned char padding[52]; // Pad to 84 bytes
+};
+
+#define DATA_PACKET_DATA_SIZE 1444
+#define DATA_PACKET_MAX_COUNT 64
+struct ntr_data_packet
+{
+	unsigned char id;
+	unsigned char is_top : 1;
+	unsigned char flags_pad : 3;
+	unsigned char is_last : 1;
+	unsigned char flags_pad2 : 3;
+	unsigned char format;
+	unsigned char order;
+
+	unsigned char data[DATA_PACKET_DATA_SIZE];
+};
+
+struct ntr_connection_setup
+{
+	struct dstr ip_address;
+	int quality;
+	int priority_factor;
+	int qos;
+	enum ntr_screen priority_screen;
+
+	bool stream_decode;
+	struct dstr stats_file_path;
+	struct dstr trace_file_path;
+	int replay_seconds;
+};
+
+// Connection statistics. The network thread publishes these a few times per second, and they can
+// be read from any thread without locking; the per-packet bookkeeping stays local to the network
+// thread so nothing is shared on the hot path.
+struct ntr_screen_stats
+{
+	volatile long packets_received;
+	volatile long packets_duplicated;
+	volatile long packets_reordered;
+	volatile long packets_lost;
+	volatile long frames_completed;
+	volatile long frames_dropped;
+
+	// The replay buffer for this screen: the frames in it and the space they fill, and the memory
+	// set aside for it as a whole.
+	volatile long replay_frames;
+	volatile long replay_kb;
+	volatile long replay_reserved_kb;
+
+	// Reassembly slots currently set aside for this screen.
+	volatile long receive_slots;
+
+	// Averages over the most recent stats interval. overlapped_decode_us is the part of each frame's
+	// decoding that was done while its packets were still arriving, which is latency saved by
+	// decoding while receiving.
+	volatile long fps_x100;
+	volatile long kbps;
+	volatile long decode_us;
+	volatile long overlapped_decode_us;
+};
+
+// A short history of frame timings for each screen, drawn by the frame graph overlay. The network
+// thread writes samples into the ring and then bumps sample_count; a reader may occasionally see a
+// sample that's being overwritten, which just shows up as one odd point in the graph.
+#define FRAME_GRAPH_SAMPLE_COUNT 128
+
+struct ntr_frame_graph_sample
+{
+	float interval_ms;
+	float latency_ms;
+	bool dropped;
+};
+
+struct ntr_frame_graph
+{
+	struct ntr_frame_graph_sample samples[FRAME_GRAPH_SAMPLE_COUNT];
+	volatile long sample_count;
+};
+
+struct ntr_stats
+{
+	volatile long connected;
+
+	struct ntr_screen_stats screens[SCREEN_COUNT];
+	struct ntr_frame_graph frame_graphs[SCREEN_COUNT];
+};
+
+#define STATS_INTERVAL_NS 500000000
+
+// The last few seconds of compressed frames for one screen, for instant replay. Frames are kept as
+// the JPEG data NTR sent, in space reserved up front when the length is set, so the network thread
+// never allocates or moves frames to keep it going.
+#define REPLAY_MAX_FPS 60
+#define REPLAY_BYTES_PER_SECOND (2 * 1024 * 1024)
+
+struct ntr_replay_frame
+{
+	uint64_t timestamp;
+	int size;
+	size_t offset;
+};
+
+struct ntr_replay_buffer
+{
+	pthread_mutex_t mutex;
+
+	// A ring of frames, oldest first.
+	struct ntr_replay_frame *frames;
+	size_t frame_capacity;
+	size_t first_frame;
+	size_t frame_count;
+
+	// The frames' data, in the same order in a ring of bytes. A frame is never split across the
+	// end of the ring; one that doesn't fit starts over at the beginning.
+	unsigned char *data;
+	size_t data_capacity;
+	size_t memory_used;
+
+	int seconds;
+	uint64_t duration_ns;
+
+	// Set while the network thread copies a frame in without holding the mutex. A new length set
+	// in the meantime waits in pending_seconds until the copy is done.
+	bool writing;
+	int pending_seconds;
+
+	struct ntr_screen_stats *stats;
+};
+
+// A frame being reassembled from its packets.
+struct ntr_frame_data
+{
+	unsigned char is_top;
+	unsigned char id;
+	unsigned char packet_count;
+	unsigned char expected_packet_count;
+	unsigned char finished;
+	int last_packet_data_size;
+	int highest_order;
+	uint64_t received_mask;
+
+	uint64_t time_started;
+
+	unsigned char *frame_data;
+};
+
+// The reassembly slots are divided between the screens, so that a burst of packets for one screen
+// can only push out that screen's own frames in progress. Each screen always gets at least
+// MIN_SCREEN_FRAMES; the rest follow the priority NTR was started with and the rate each screen's
+// frames are actually arriving at.
+#define CONCURRENT_FRAMES 8
+#define MIN_SCREEN_FRAMES 2
+struct ntr_connection_data
+{
+	pthread_t net_thread;
+	pthread_mutex_t buffer_mutex[SCREEN_COUNT];
+	bool net_thread_started;
+	bool net_thread_exited;
+	bool disconnect_requested;
+	bool stream_decode;
+
+	// The priority settings NTR was started with, which decide how the reassembly slots are divided
+	// until there's a measured rate to go by.
+	int priority_factor;
+	enum ntr_screen priority_screen;
+
+	// Supplied by whoever creates the connection. The replay buffers may be NULL.
+	struct ntr_stats *stats;
+	struct ntr_replay_buffer *replay_buffers;
+
+	// How many consumers currently want each screen decoded, and how many want its compressed
+	// frames. Also supplied by the creator, and may be changed at any time.
+	volatile long *decode_demand;
+	volatile long *compressed_demand;
+
+	// Optional hooks, called on the network thread. frame_decoded is called with each newly decoded
+	// image, and frame_received with each complete compressed frame that's wanted; consumers that do
+	// their own decoding get frames only through frame_received. frame_decoded may keep the image
+	// buffer, which was allocated with bmalloc and is TEMP_BUFFER_SIZE bytes, by returning another
+	// buffer like it for the next image to be decoded into; otherwise it returns image_data.
+	unsigned char *(*frame_decoded)(void *param, enum ntr_screen screen, unsigned char *image_data);
+	void (*frame_received)(void *param, enum ntr_screen screen, const unsigned char *frame_data, int frame_size);
+	void *callback_param;
+
+	// Optional; every datagram read from the data socket is appended to this packet trace.
+	FILE *trace_file;
+
+	// The newest decoded image for each screen, for obs_ntr_copy_latest_frame. Consumers that only
+	// use frame_decoded can clear keep_latest_frame to skip copying every image here.
+	bool keep_latest_frame;
+	unsigned char *uncompressed_buffer[SCREEN_COUNT];
+	int last_frame_id[SCREEN_COUNT];
+
+	// Where complete frames are decoded; only used on the network thread.
+	unsigned char *decode_buffer[SCREEN_COUNT];
+
+	// Per screen, over roughly its last 100 frames. last_stat_time changes whenever any of these do.
+	int dropped_frames[SCREEN_COUNT];
+	int total_processed_frames[SCREEN_COUNT];
+	float fps[SCREEN_COUNT];
+	float decode_ms[SCREEN_COUNT];
+	float overlapped_decode_ms[SCREEN_COUNT];
+	int receive_slots[SCREEN_COUNT];
+	uint64_t last_stat_time;
+};
+
+
+// Sends NTR the command to start sending remote view frames, using the given settings.
+bool obs_ntr_send_remoteview_startup(const struct ntr_connection_setup *setup);
+
+bool obs_ntr_decode_image(tjhandle decompressor_handle, enum ntr_screen screen,
+	const unsigned char *frame_data, int frame_size, unsigned char *image_data);
+
+// The per-frame steps of receiving, exposed so they can be benchmarked on their own.
+
+// Finds the slot already collecting the packet's frame, or else the one that's been collecting
+// its frame the longest, which the caller will take over.
+struct ntr_frame_data *obs_ntr_find_frame_slot(struct ntr_frame_data *frames, int frame_count, const struct ntr_data_packet *packet);
+
+// Divides the CONCURRENT_FRAMES reassembly slots between the screens in proportion to the given
+// weights, giving each at least MIN_SCREEN_FRAMES.
+void obs_ntr_divide_frame_slots(const double *weights, int *frame_counts);
+
+// Copies a packet's data into its place in the frame.
+void obs_ntr_store_packet(struct ntr_frame_data *frame, const struct ntr_data_packet *packet, int packet_size);
+
+// Hands a decoded image over to whoever is displaying it. Returns the buffer to decode the next
+// image into, which is image_data unless the frame_decoded hook kept it.
+unsigned char *obs_ntr_publish_frame(struct ntr_connection_data *connection_data, enum ntr_screen screen, unsigned char id,
+	unsigned char *image_data);
+
+// Copies out the newest decoded image for a screen, returning its frame id.
+int obs_ntr_copy_latest_frame(struct ntr_connection_data *connection_data, enum ntr_screen screen, unsigned char *image_data);
+
+void obs_ntr_replay_buffer_init(struct ntr_replay_buffer *buffer, struct ntr_screen_stats *stats);
+void obs_ntr_replay_buffer_free(struct ntr_replay_buffer *buffer);
+
+// Sets how many seconds of frames to keep, reserving the space for them. Changing the length
+// discards what's already in the buffer.
+void obs_ntr_replay_buffer_set_duration(struct ntr_replay_buffer *buffer, int seconds);
+
+// These must be called with the buffer's mutex held. Frames are indexed from the oldest, at 0.
+struct ntr_replay_frame *obs_ntr_replay_buffer_get(struct ntr_replay_buffer *buffer, long frame_index);
+long obs_ntr_replay_buffer_find(struct ntr_replay_buffer *buffer, uint64_t timestamp);
+
+// Allocates the connection's buffers. The caller fills in the stats, demand, and any other
+// optional fields before starting it.
+struct ntr_connection_data *obs_ntr_connection_alloc(void);
+void obs_ntr_connection_start(struct ntr_connection_data *connection_data);
+
+// Stops the network thread if it's running and frees the connection.
+void obs_ntr_connection_free(struct ntr_connection_data *connection_data);
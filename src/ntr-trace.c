@@ -0,0 +1,124 @@
+#include "ntr-trace.h"
+
+#include <util/base.h>
+#include <util/platform.h>
+
+#include <string.h>
+
+#define TRACE_FILE_BUFFER_SIZE (1024 * 1024)
+
+static void obs_ntr_trace_write_u32(FILE *trace_file, uint32_t value)
+{
+	unsigned char bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF };
+	fwrite(bytes, 1, sizeof(bytes), trace_file);
+}
+
+static bool obs_ntr_trace_read_u32(FILE *trace_file, uint32_t *value)
+{
+	unsigned char bytes[4];
+	if (fread(bytes, 1, sizeof(bytes), trace_file) != sizeof(bytes))
+	{
+		return false;
+	}
+
+	*value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+	return true;
+}
+
+FILE *obs_ntr_trace_create(const char *path, const struct ntr_connection_setup *setup)
+{
+	FILE *trace_file = os_fopen(path, "wb");
+	if (trace_file == NULL)
+	{
+		blog(LOG_WARNING, "obs-ntr: Unable to create packet trace %s", path);
+		return NULL;
+	}
+
+	// Packets are written from the network thread, so give it plenty of room before it has to
+	// wait on the disk.
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_FILE_BUFFER_SIZE);
+
+	fwrite(NTR_TRACE_MAGIC, 1, 4, trace_file);
+	obs_ntr_trace_write_u32(trace_file, NTR_TRACE_VERSION);
+	obs_ntr_trace_write_u32(trace_file, setup->quality);
+	obs_ntr_trace_write_u32(trace_file, setup->qos);
+	obs_ntr_trace_write_u32(trace_file, setup->priority_factor);
+	obs_ntr_trace_write_u32(trace_file, setup->priority_screen);
+
+	return trace_file;
+}
+
+void obs_ntr_trace_write_packet(FILE *trace_file, uint64_t timestamp_ns, const struct ntr_data_packet *packet, int packet_size)
+{
+	obs_ntr_trace_write_u32(trace_file, (uint32_t)timestamp_ns);
+	obs_ntr_trace_write_u32(trace_file, (uint32_t)(timestamp_ns >> 32));
+	obs_ntr_trace_write_u32(trace_file, packet_size);
+	fwrite(packet, 1, packet_size, trace_file);
+}
+
+FILE *obs_ntr_trace_open(const char *path, struct ntr_trace_header *header)
+{
+	FILE *trace_file = os_fopen(path, "rb");
+	if (trace_file == NULL)
+	{
+		blog(LOG_WARNING, "obs-ntr: Unable to open packet trace %s", path);
+		return NULL;
+	}
+
+	char magic[4];
+	uint32_t values[5];
+	if (fread(magic, 1, 4, trace_file) != 4 || memcmp(magic, NTR_TRACE_MAGIC, 4) != 0)
+	{
+		blog(LOG_WARNING, "obs-ntr: %s is not a packet trace", path);
+		goto exception;
+	}
+
+	for (int value_index = 0; value_index < 5; value_index++)
+	{
+		if (!obs_ntr_trace_read_u32(trace_file, &values[value_index]))
+		{
+			blog(LOG_WARNING, "obs-ntr: Packet trace %s is truncated", path);
+			goto exception;
+		}
+	}
+
+	if (values[0] != NTR_TRACE_VERSION)
+	{
+		blog(LOG_WARNING, "obs-ntr: Packet trace %s has unsupported version %u", path, values[0]);
+		goto exception;
+	}
+
+	header->version = values[0];
+	header->quality = values[1];
+	header->qos = values[2];
+	header->priority_factor = values[3];
+	header->priority_screen = values[4];
+
+	return trace_file;
+
+exception:
+	fclose(trace_file);
+	return NULL;
+}
+
+bool obs_ntr_trace_read_packet(FILE *trace_file, uint64_t *timestamp_ns, struct ntr_data_packet *packet, int *packet_size)
+{
+	uint32_t timestamp_low;
+	uint32_t timestamp_high;
+	uint32_t size;
+
+	if (!obs_ntr_trace_read_u32(trace_file, &timestamp_low) || !obs_ntr_trace_read_u32(trace_file, &timestamp_high) ||
+		!obs_ntr_trace_read_u32(trace_file, &size) || size > sizeof(struct ntr_data_packet))
+	{
+		return false;
+	}
+
+	if (fread(packet, 1, size, trace_file) != size)
+	{
+		return false;
+	}
+
+	*timestamp_ns = ((uint64_t)timestamp_high << 32) | timestamp_low;
+	*packet_size = (int)size;
+	return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ntr-connection.h"
+
+#include <stdio.h>
+
+// Packet traces, for working out better connection settings offline (see tools/ntr-advisor.c). A
+// trace is a header recording the settings NTR was started with, followed by every datagram read
+// from the data socket, each preceded by the time it was read and its size. All values are
+// little-endian.
+#define NTR_TRACE_MAGIC "NTRT"
+#define NTR_TRACE_VERSION 1
+
+struct ntr_trace_header
+{
+	int version;
+	int quality;
+	int qos;
+	int priority_factor;
+	enum ntr_screen priority_screen;
+};
+
+// Creates a trace file and writes its header. Returns NULL if the file can't be created.
+FILE *obs_ntr_trace_create(const char *path, const struct ntr_connection_setup *setup);
+void obs_ntr_trace_write_packet(FILE *trace_file, uint64_t timestamp_ns, const struct ntr_data_packet *packet, int packet_size);
+
+// Opens a trace for reading and reads its header. Returns NULL if it isn't a trace this version
+// can read.
+FILE *obs_ntr_trace_open(const char *path, struct ntr_trace_header *header);
+
+// Reads the next packet, returning false at the end of the trace.
+bool obs_ntr_trace_read_packet(FILE *trace_file, uint64_t *timestamp_ns, struct ntr_data_packet *packet, int *packet_size);
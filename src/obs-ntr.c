@@ -1,114 +1,16 @@
 #include <obs-module.h>
+#include <callback/proc.h>
+#include <util/darray.h>
 #include <util/dstr.h>
 #include <util/platform.h>
 #include <util/threading.h>
 
-#include <turbojpeg.h>
-
-#include <WinSock2.h>
-
-// Extracted from ns.h in the NTR source.
-enum ntr_command_type
-{
-	NS_TYPE_NORMAL,
-	NS_TYPE_BIGDATA
-};
-
-enum ntr_command
-{
-	NS_CMD_HEARTBEAT = 0,
-	NS_CMD_REMOTEPLAY = 901
-};
-
-
-enum ntr_screen
-{
-	SCREEN_BOTTOM,
-	SCREEN_TOP,
-
-	SCREEN_COUNT
-};
-
-const int SCREEN_WIDTH[SCREEN_COUNT] =
-{
-	320, 
-	400
-};
+#include <errno.h>
 
-const int SCREEN_HEIGHT[SCREEN_COUNT] =
-{
-	240,
-	240
-};
-
-#define TEMP_BUFFER_SIZE (320 * 400 * 4)
-
-struct ntr_command_packet
-{
-	int magic_number;
-	int sequence;
-	enum ntr_command_type type;
-	enum ntr_command command;
-	int args[4];
-
-	unsigned char padding[52]; // Pad to 84 bytes
-};
-
-#define DATA_PACKET_DATA_SIZE 1444
-#define DATA_PACKET_MAX_COUNT 64
-struct ntr_data_packet
-{
-	unsigned char id;
-	unsigned char is_top : 1;
-	unsigned char flags_pad : 3;
-	unsigned char is_last : 1;
-	unsigned char flags_pad2 : 3;
-	unsigned char format;
-	unsigned char order;
-
-	unsigned char data[DATA_PACKET_DATA_SIZE];
-};
-
-struct ntr_connection_setup
-{
-	struct dstr ip_address;
-	int quality;
-	int priority_factor;
-	int qos;
-	enum ntr_screen priority_screen;
-};
-
-struct ntr_frame_data
-{
-	unsigned char is_top;
-	unsigned char id;
-	unsigned char packet_count;
-	unsigned char expected_packet_count;
-	unsigned char finished;
-	int last_packet_data_size;
-
-	uint64_t time_started;
-
-	unsigned char *frame_data;
-};
-
-#define CONCURRENT_FRAMES 4
-struct ntr_connection_data
-{
-	pthread_t net_thread;
-	pthread_mutex_t buffer_mutex[SCREEN_COUNT];
-	bool net_thread_started;
-	bool net_thread_exited;
-	bool disconnect_requested;
-
-	unsigned char *uncompressed_buffer[SCREEN_COUNT];
-	int last_frame_id[SCREEN_COUNT];
+#include <turbojpeg.h>
 
-	int dropped_frames;
-	int total_processed_frames;
-	float fps;
-	uint64_t last_stat_time;
-};
+#include "ntr-connection.h"
+#include "ntr-trace.h"
 
 struct ntr_data
 {
@@ -118,7 +20,23 @@ struct ntr_data
 	bool pending_property_refresh;
 
 	enum ntr_screen screen;
-	int last_frame_id;
+	bool holds_screen_texture;
+
+	// Region of the screen to show, in upright screen coordinates. Cropped sources show a decode of
+	// just this region, shared with any other source cropping the same region, instead of sampling
+	// the shared screen texture.
+	int crop_left;
+	int crop_top;
+	int crop_width;
+	int crop_height;
+
+	struct ntr_crop_region *crop_region;
+	long crop_sequence;
+	gs_texture_t *crop_texture;
+	int crop_texture_width;
+	int crop_texture_height;
+	int crop_offset_x;
+	int crop_offset_y;
 
 	struct ntr_connection_setup connection_setup;
 
@@ -126,351 +44,443 @@ struct ntr_data
 	bool startup_remoteview_thread_started;
 	bool startup_remoteview_thread_running;
 
-	gs_texture_t *texture;
+	bool showing;
+	bool counted_showing;
+	bool counted_cropped;
+	enum ntr_screen counted_screen;
 
 	bool show_stats;
+	bool show_frame_graph;
 	obs_source_t *debug_text_source;
 	uint64_t last_stat_time;
 	bool update_debug_text;
 };
 
-
 void *obs_ntr_startup_remoteview_thread_run(void *data)
 {
 	struct ntr_data *context = data;
 
 	context->startup_remoteview_thread_running = true;
 
-	struct sockaddr_in client_address;
-	client_address.sin_family = AF_INET;
-	client_address.sin_addr.s_addr = htons(INADDR_ANY);
-	client_address.sin_port = 0;
+	bool succeeded = obs_ntr_send_remoteview_startup(&context->connection_setup);
 
-	struct sockaddr_in server_address;
-	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = inet_addr(context->connection_setup.ip_address.array);
-	server_address.sin_port = htons(8000);
+	context->startup_remoteview_thread_running = false;
 
+	return succeeded ? 0 : (void *)1;
+}
 
-	SOCKET command_socket = socket(AF_INET, SOCK_STREAM, 0);
+static const char *SCREEN_STATS_NAME[SCREEN_COUNT] =
+{
+	"bottom",
+	"top"
+};
 
-	if (command_socket == INVALID_SOCKET)
-	{
-		blog(LOG_WARNING, "obs-ntr: Failed to create socket to send startup command to NTR");
-		goto exception;
-	}
+static obs_data_t *obs_ntr_stats_snapshot(struct ntr_stats *stats)
+{
+	obs_data_t *snapshot = obs_data_create();
 
-	if (bind(command_socket, (struct sockaddr *)&client_address, sizeof(struct sockaddr_in)) != 0)
-	{
-		blog(LOG_WARNING, "obs-ntr: Failed to bind socket to send startup command to NTR");
-		goto exception;
-	}
+	obs_data_set_bool(snapshot, "connected", os_atomic_load_long(&stats->connected) != 0);
 
-	if (connect(command_socket, (struct sockaddr *)&server_address, sizeof(struct sockaddr_in)) != 0)
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
 	{
-		blog(LOG_WARNING, "obs-ntr: Failed to connect to %s to send startup command to NTR", context->connection_setup.ip_address.array);
-		goto exception;
+		struct ntr_screen_stats *screen_stats = &stats->screens[screen_index];
+		obs_data_t *screen_snapshot = obs_data_create();
+
+		obs_data_set_double(screen_snapshot, "fps", os_atomic_load_long(&screen_stats->fps_x100) / 100.0);
+		obs_data_set_double(screen_snapshot, "decode_ms", os_atomic_load_long(&screen_stats->decode_us) / 1000.0);
+		obs_data_set_double(screen_snapshot, "overlapped_decode_ms", os_atomic_load_long(&screen_stats->overlapped_decode_us) / 1000.0);
+		obs_data_set_int(screen_snapshot, "kbps", os_atomic_load_long(&screen_stats->kbps));
+		obs_data_set_int(screen_snapshot, "packets_received", os_atomic_load_long(&screen_stats->packets_received));
+		obs_data_set_int(screen_snapshot, "packets_lost", os_atomic_load_long(&screen_stats->packets_lost));
+		obs_data_set_int(screen_snapshot, "packets_duplicated", os_atomic_load_long(&screen_stats->packets_duplicated));
+		obs_data_set_int(screen_snapshot, "packets_reordered", os_atomic_load_long(&screen_stats->packets_reordered));
+		obs_data_set_int(screen_snapshot, "frames_completed", os_atomic_load_long(&screen_stats->frames_completed));
+		obs_data_set_int(screen_snapshot, "frames_dropped", os_atomic_load_long(&screen_stats->frames_dropped));
+		obs_data_set_int(screen_snapshot, "replay_frames", os_atomic_load_long(&screen_stats->replay_frames));
+		obs_data_set_int(screen_snapshot, "replay_kb", os_atomic_load_long(&screen_stats->replay_kb));
+		obs_data_set_int(screen_snapshot, "replay_reserved_kb", os_atomic_load_long(&screen_stats->replay_reserved_kb));
+		obs_data_set_int(screen_snapshot, "receive_slots", os_atomic_load_long(&screen_stats->receive_slots));
+
+		obs_data_set_obj(snapshot, SCREEN_STATS_NAME[screen_index], screen_snapshot);
+		obs_data_release(screen_snapshot);
 	}
 
-	struct ntr_command_packet start_command;
-	start_command.magic_number = 0x12345678;
-	start_command.sequence = 1;
-	start_command.type = NS_TYPE_NORMAL;
-	start_command.command = NS_CMD_REMOTEPLAY;
-	start_command.args[0] = (context->connection_setup.priority_screen << 8) | context->connection_setup.priority_factor;
-	start_command.args[1] = context->connection_setup.quality;
-	start_command.args[2] = context->connection_setup.qos * 1024 * 1024 / 8;
+	return snapshot;
+}
 
-	if (send(command_socket, (const char *)&start_command, sizeof(struct ntr_command_packet), 0) < 0)
-	{
-		blog(LOG_WARNING, "obs-ntr: Failed sending startup command to NTR");
-		goto exception;
-	}
+#define STATS_FILE_INTERVAL_MS 1000
 
-	// The original NTRViewer sends three heartbeats after starting up remoteview for some reason. 
-	// Probably this is used to verify that the NTR service on the 3DS didn't crash on boot or something?
-	// In any case, NTR will not send any data packets back until we do this. 
-	os_sleep_ms(100);
+// Rewrites a JSON file with the stats snapshot once per interval while connected.
+struct ntr_stats_file_writer
+{
+	struct ntr_stats *stats;
+	struct dstr path;
+	pthread_t thread;
+	os_event_t *stop_event;
+};
 
-	struct ntr_command_packet heartbeat_command;
-	heartbeat_command.magic_number = 0x12345678;
-	heartbeat_command.type = NS_TYPE_NORMAL;
-	heartbeat_command.command = NS_CMD_HEARTBEAT;
-	for (int ping_index = 0; ping_index < 3; ping_index++)
+void *obs_ntr_stats_file_thread_run(void *data)
+{
+	struct ntr_stats_file_writer *writer = data;
+
+	while (os_event_timedwait(writer->stop_event, STATS_FILE_INTERVAL_MS) == ETIMEDOUT)
 	{
-		heartbeat_command.sequence = ping_index + 2;
-		if (send(command_socket, (const char *)&heartbeat_command, sizeof(struct ntr_command_packet), 0) < 0)
+		obs_data_t *snapshot = obs_ntr_stats_snapshot(writer->stats);
+
+		// Written to a temporary file and renamed, so readers never see a partial file.
+		if (!obs_data_save_json_safe(snapshot, writer->path.array, "tmp", NULL))
 		{
-			blog(LOG_WARNING, "obs-ntr: Failed sending initial heartbeat to NTR");
-			goto exception;
+			blog(LOG_WARNING, "obs-ntr: Failed writing stats to %s", writer->path.array);
 		}
 
-		os_sleep_ms(100);
+		obs_data_release(snapshot);
 	}
 
-	closesocket(command_socket);
+	return 0;
+}
 
-	blog(LOG_WARNING, "obs-ntr: Startup command sent successfully to NTR");
+static struct ntr_data *connection_owner = NULL;
+static struct ntr_connection_data *shared_connection_data = NULL;
 
-	context->startup_remoteview_thread_running = false;
+// Kept outside of the connection data so it can be safely read at any time, even while a
+// connection is being torn down.
+static struct ntr_stats connection_stats;
 
-	return 0;
+// Also kept outside of the connection data, so replays remain available after disconnecting.
+static struct ntr_replay_buffer replay_buffers[SCREEN_COUNT];
 
-exception:
+static struct ntr_stats_file_writer stats_file_writer;
+static FILE *trace_file = NULL;
 
-	if (command_socket != INVALID_SOCKET)
-	{
-		closesocket(command_socket);
-	}
-	context->startup_remoteview_thread_running = false;
-	return (void *)1;
-}
+// Number of sources currently showing each screen. Frames for a screen that nobody is showing
+// are still reassembled (so the stats stay meaningful), but are not decoded or uploaded.
+static volatile long screen_show_count[SCREEN_COUNT];
+
+// Number of cropped sources currently showing each screen. These only need the compressed frame,
+// and don't count towards screen_show_count.
+static volatile long cropped_show_count[SCREEN_COUNT];
+
+// The regions that cropped sources are showing. Each distinct region is cropped and decoded once
+// per frame on the network thread, however many sources show it, and the sources only copy out
+// the result and upload it. The transform can only crop on MCU boundaries, so the decoded image
+// may include a few extra pixels above and to the left of the region, which are skipped when
+// rendering.
+#define MAX_CROP_REGIONS 8
 
-#define DATA_SOCKET_TIMEOUT_DURATION_NS 1000000000
+struct ntr_crop_region
+{
+	int refs;
+	enum ntr_screen screen;
+	int left;
+	int top;
+	int width;
+	int height;
+
+	// Written by the network thread with crop_regions_mutex held.
+	long sequence;
+	unsigned char *image_data;
+	int image_width;
+	int image_height;
+	int offset_x;
+	int offset_y;
+};
 
-void *obs_ntr_net_thread_run(void *data)
+static pthread_mutex_t crop_regions_mutex;
+static struct ntr_crop_region crop_regions[MAX_CROP_REGIONS];
+
+// Only used on the network thread. The cropped JPEGs go into buffers allocated up front, big enough
+// for a whole frame at any subsampling, so the transform never has to reallocate them.
+static tjhandle crop_transform_handle = NULL;
+static tjhandle crop_decompressor_handle = NULL;
+static unsigned char *crop_jpeg_data[MAX_CROP_REGIONS];
+static unsigned long crop_jpeg_size[MAX_CROP_REGIONS];
+static unsigned long crop_jpeg_capacity = 0;
+
+// One texture per screen, shared by every source showing that screen, so each new frame is only
+// uploaded once no matter how many scenes it appears in. These are only touched from within the
+// graphics context. 
+struct ntr_screen_texture
 {
-	struct ntr_connection_data *connection_data = data;
+	gs_texture_t *texture;
+	int refs;
+	int last_frame_id;
+};
 
-	tjhandle decompressor_handle = tjInitDecompress();
+static struct ntr_screen_texture screen_textures[SCREEN_COUNT];
 
-	struct ntr_frame_data frames[CONCURRENT_FRAMES];
-	for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
-	{
-		frames[frame_index].id = 0;
-		frames[frame_index].packet_count = 0;
-		frames[frame_index].expected_packet_count = 0;
-		frames[frame_index].last_packet_data_size = 0;
-		frames[frame_index].finished = 0;
-		frames[frame_index].time_started = 0;
+// Must be called from within the graphics context.
+static void obs_ntr_screen_texture_acquire(enum ntr_screen screen)
+{
+	struct ntr_screen_texture *screen_texture = &screen_textures[screen];
 
-		frames[frame_index].frame_data = bzalloc(DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT);
+	if (screen_texture->refs++ == 0)
+	{
+		screen_texture->texture = gs_texture_create(SCREEN_HEIGHT[screen], SCREEN_WIDTH[screen], GS_RGBA, 1, NULL, GS_DYNAMIC);
+		screen_texture->last_frame_id = -1;
 	}
+}
 
-	connection_data->disconnect_requested = false;
-	
-	struct sockaddr_in data_socket_address_data;
-	data_socket_address_data.sin_family = AF_INET;
-	data_socket_address_data.sin_addr.s_addr = htonl(INADDR_ANY);
-	data_socket_address_data.sin_port = htons(8001);
-
-	SOCKET data_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+// Must be called from within the graphics context.
+static void obs_ntr_screen_texture_release(enum ntr_screen screen)
+{
+	struct ntr_screen_texture *screen_texture = &screen_textures[screen];
 
-	if (data_socket == INVALID_SOCKET)
+	if (--screen_texture->refs == 0)
 	{
-		blog(LOG_WARNING, "obs-ntr: Failed creating a data socket");
-		goto exception;
+		gs_texture_destroy(screen_texture->texture);
+		screen_texture->texture = NULL;
 	}
+}
+
+static bool obs_ntr_screen_texture_needs_upload(enum ntr_screen screen)
+{
+	return screen_textures[screen].refs > 0 && os_atomic_load_long(&screen_show_count[screen]) > 0 &&
+		shared_connection_data->last_frame_id[screen] != screen_textures[screen].last_frame_id;
+}
 
-	if (bind(data_socket, (struct sockaddr *)&data_socket_address_data, sizeof(struct sockaddr_in)) != 0)
+// Registered as a global tick callback, so it runs once per video frame before any of the sources
+// tick. All screens with a new frame are uploaded within a single graphics context entry.
+static void obs_ntr_upload_tick(void *param, float seconds)
+{
+	UNUSED_PARAMETER(param);
+	UNUSED_PARAMETER(seconds);
+
+	if (shared_connection_data == NULL)
 	{
-		blog(LOG_WARNING, "obs-ntr: Failed binding a data socket");
-		goto exception;
+		return;
 	}
 
-	int buffer_size = 8 * 1024 * 1024;
-	struct timeval timeout;
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
-	if (setsockopt(data_socket, SOL_SOCKET, SO_RCVBUF, (char *)&buffer_size, sizeof(int)) != 0)
+	bool any_needs_upload = false;
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
 	{
-		blog(LOG_WARNING, "obs-ntr: Unable to set buffer size on data socket");
+		any_needs_upload = any_needs_upload || obs_ntr_screen_texture_needs_upload(screen_index);
 	}
 
-	if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(struct timeval)) != 0)
+	if (!any_needs_upload)
 	{
-		blog(LOG_WARNING, "obs-ntr: Unable to set timeout on data socket");
+		return;
 	}
 
-	int frames_processed = 0;
-	int frames_dumped = 0;
-	uint64_t last_stat_time = obs_get_video_frame_time();
-	uint64_t last_read_time = obs_get_video_frame_time();
+	unsigned char local_image_buffer[TEMP_BUFFER_SIZE];
 
-	connection_data->last_stat_time = last_stat_time;
+	obs_enter_graphics();
 
-	while (!connection_data->disconnect_requested)
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
 	{
-		if (frames_processed >= 100)
+		// Check again now that we're in the graphics context, since the texture may have been released.
+		if (obs_ntr_screen_texture_needs_upload(screen_index))
 		{
-			uint64_t now = obs_get_video_frame_time();
+			screen_textures[screen_index].last_frame_id = obs_ntr_copy_latest_frame(shared_connection_data, screen_index, local_image_buffer);
 
-			uint64_t elapsed_ms = (now - last_stat_time) / 1000000;
-			float elapsed_seconds = (float)(elapsed_ms) / 1000.0f;
-			float fps = (frames_processed - frames_dumped) / elapsed_seconds;
+			gs_texture_set_image(screen_textures[screen_index].texture, local_image_buffer, SCREEN_HEIGHT[screen_index] * 4, false);
+		}
+	}
 
-			connection_data->dropped_frames = frames_dumped;
-			connection_data->total_processed_frames = frames_processed;
-			connection_data->fps = fps;
-			connection_data->last_stat_time = now;
+	obs_leave_graphics();
+}
 
-			frames_processed = 0;
-			frames_dumped = 0;
-			last_stat_time = now;
-		}
+static bool obs_ntr_crop_region_matches(const struct ntr_crop_region *region, const struct ntr_data *context)
+{
+	return region->screen == context->screen && region->left == context->crop_left && region->top == context->crop_top &&
+		region->width == context->crop_width && region->height == context->crop_height;
+}
 
-		struct sockaddr_in from_address;
-		int from_address_length = sizeof(struct sockaddr_in);
-		struct ntr_data_packet packet;
-		int receive_result = recvfrom(data_socket, (char *)&packet, sizeof(struct ntr_data_packet), 0, (struct sockaddr *)&from_address, &from_address_length);
+// Finds or sets up the crop region for a source's screen and crop settings. Returns NULL if there
+// are already too many different regions being shown. Must be called with crop_regions_mutex held.
+static struct ntr_crop_region *obs_ntr_crop_region_acquire(const struct ntr_data *context)
+{
+	struct ntr_crop_region *found_region = NULL;
 
-		if (receive_result > 0)
+	for (int region_index = 0; region_index < MAX_CROP_REGIONS; region_index++)
+	{
+		if (crop_regions[region_index].refs > 0 && obs_ntr_crop_region_matches(&crop_regions[region_index], context))
 		{
-			struct ntr_frame_data *active_frame = NULL;
+			found_region = &crop_regions[region_index];
+			break;
+		}
+	}
 
-			//blog(LOG_DEBUG, "obs-ntr: Received packet %d of frame id %d(%d)", packet.order, packet.id, packet.is_top);
-			//blog(LOG_DEBUG, "obs-ntr: Current frames: %d(%d) %d(%d) %d(%d) %d(%d)", connection_data->frames[0].id, connection_data->frames[0].is_top,
-				//connection_data->frames[1].id, connection_data->frames[1].is_top, connection_data->frames[2].id, connection_data->frames[2].is_top,
-				//connection_data->frames[3].id, connection_data->frames[3].is_top);
+	for (int region_index = 0; found_region == NULL && region_index < MAX_CROP_REGIONS; region_index++)
+	{
+		if (crop_regions[region_index].refs == 0)
+		{
+			found_region = &crop_regions[region_index];
+			found_region->screen = context->screen;
+			found_region->left = context->crop_left;
+			found_region->top = context->crop_top;
+			found_region->width = context->crop_width;
+			found_region->height = context->crop_height;
+			found_region->sequence = 0;
+			found_region->image_data = bzalloc(TEMP_BUFFER_SIZE);
+			found_region->image_width = 0;
+			found_region->image_height = 0;
+			found_region->offset_x = 0;
+			found_region->offset_y = 0;
+		}
+	}
 
-			last_read_time = obs_get_video_frame_time();
+	if (found_region != NULL)
+	{
+		found_region->refs++;
+	}
 
-			for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
-			{
-				if (frames[frame_index].id == packet.id && frames[frame_index].is_top == packet.is_top)
-				{
-					//blog(LOG_DEBUG, "obs-ntr: Found existing frame");
-					active_frame = &frames[frame_index];
-					break;
-				}
-			}
+	return found_region;
+}
 
-			if (active_frame == NULL)
-			{
-				int oldest_index = 0;
-				uint64_t oldest_time = UINT64_MAX;
-				for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
-				{
-					if (frames[frame_index].time_started < oldest_time)
-					{
-						oldest_time = frames[frame_index].time_started;
-						oldest_index = frame_index;
-					}
-				}
-
-				//blog(LOG_DEBUG, "obs-ntr: Replacing old frame %d", connection_data->frames[oldest_index].id);
-
-				active_frame = &frames[oldest_index];
-			}
+// Must be called with crop_regions_mutex held.
+static void obs_ntr_crop_region_release(struct ntr_crop_region *region)
+{
+	if (--region->refs == 0)
+	{
+		bfree(region->image_data);
+		region->image_data = NULL;
+		region->image_width = 0;
+		region->image_height = 0;
+	}
+}
 
-			assert(active_frame != NULL);
+struct ntr_crop_job
+{
+	struct ntr_crop_region region;
+	struct ntr_crop_region *target;
+	tjtransform transform;
+};
 
-			if (active_frame->id != packet.id || active_frame->is_top != packet.is_top || active_frame->finished)
-			{
-				if (!active_frame->finished)
-				{
-					//blog(LOG_DEBUG, "obs-ntr: Dumping frame %d (%d/%d) for frame %d (%d)", active_frame->id,
-						//active_frame->packet_count, active_frame->expected_packet_count,
-						//packet.id, packet.is_top);
-
-					frames_processed++;
-					frames_dumped++;
-				}
-
-				active_frame->is_top = packet.is_top;
-				active_frame->id = packet.id;
-				active_frame->expected_packet_count = 0;
-				active_frame->packet_count = 0;
-				active_frame->last_packet_data_size = 0;
-				active_frame->finished = false;
-				active_frame->time_started = obs_get_video_frame_time();
-			}
+// Called on the network thread with each complete frame for a screen that cropped sources are
+// showing. All the regions for the screen are cropped in a single transform, so the frame is only
+// entropy decoded once, and then each region is decoded on its own.
+static void obs_ntr_crop_frame_received(void *param, enum ntr_screen screen, const unsigned char *frame_data, int frame_size)
+{
+	UNUSED_PARAMETER(param);
 
-			if (packet.is_last)
-			{
-				active_frame->expected_packet_count = packet.order + 1;
-				active_frame->last_packet_data_size = receive_result - 4;
+	struct ntr_crop_job jobs[MAX_CROP_REGIONS];
+	int job_count = 0;
 
-				memcpy(active_frame->frame_data + (DATA_PACKET_DATA_SIZE * packet.order), packet.data,
-					active_frame->last_packet_data_size);
-			}
-			else
-			{
-				memcpy(active_frame->frame_data + (DATA_PACKET_DATA_SIZE * packet.order), packet.data, DATA_PACKET_DATA_SIZE);
-			}
+	pthread_mutex_lock(&crop_regions_mutex);
+	for (int region_index = 0; region_index < MAX_CROP_REGIONS; region_index++)
+	{
+		if (crop_regions[region_index].refs > 0 && crop_regions[region_index].screen == screen)
+		{
+			jobs[job_count].region = crop_regions[region_index];
+			jobs[job_count].target = &crop_regions[region_index];
+			job_count++;
+		}
+	}
+	pthread_mutex_unlock(&crop_regions_mutex);
 
-			active_frame->packet_count++;
+	int jpeg_width, jpeg_height, jpeg_subsampling, jpeg_colorspace;
+	if (job_count == 0 || tjDecompressHeader3(crop_decompressor_handle, frame_data, frame_size,
+		&jpeg_width, &jpeg_height, &jpeg_subsampling, &jpeg_colorspace) != 0)
+	{
+		return;
+	}
 
-			//blog(LOG_DEBUG, "obs-ntr: Frame %d now has %d/%d packets", active_frame->id, active_frame->packet_count, active_frame->expected_packet_count);
+	tjtransform transforms[MAX_CROP_REGIONS];
+	for (int job_index = 0; job_index < job_count; job_index++)
+	{
+		struct ntr_crop_job *job = &jobs[job_index];
+
+		// Frames are rotated; upright x runs down the image, and upright y runs right to left.
+		int region_x = SCREEN_HEIGHT[screen] - job->region.top - job->region.height;
+		int region_y = job->region.left;
+
+		memset(&transforms[job_index], 0, sizeof(tjtransform));
+		transforms[job_index].op = TJXOP_NONE;
+		transforms[job_index].options = TJXOPT_CROP;
+		transforms[job_index].r.x = region_x - region_x % tjMCUWidth[jpeg_subsampling];
+		transforms[job_index].r.y = region_y - region_y % tjMCUHeight[jpeg_subsampling];
+		transforms[job_index].r.w = job->region.height + (region_x - transforms[job_index].r.x);
+		transforms[job_index].r.h = job->region.width + (region_y - transforms[job_index].r.y);
+
+		job->region.offset_x = region_x - transforms[job_index].r.x;
+		job->region.offset_y = region_y - transforms[job_index].r.y;
+	}
 
-			if (active_frame->expected_packet_count > 0 && active_frame->packet_count >= active_frame->expected_packet_count)
-			{
-				char local_decompress_buffer[TEMP_BUFFER_SIZE];
+	for (int job_index = 0; job_index < job_count; job_index++)
+	{
+		crop_jpeg_size[job_index] = crop_jpeg_capacity;
+	}
 
-				//blog(LOG_DEBUG, "obs-ntr: Finishing frame %d with %d/%d packets", active_frame->id, active_frame->packet_count, active_frame->expected_packet_count);
+	if (tjTransform(crop_transform_handle, frame_data, frame_size, job_count,
+		crop_jpeg_data, crop_jpeg_size, transforms, TJFLAG_NOREALLOC) != 0)
+	{
+		blog(LOG_DEBUG, "obs-ntr: Failed cropping frame: %s", tjGetErrorStr());
+		return;
+	}
 
-				active_frame->finished = true;
-				frames_processed++;
+	unsigned char local_image_buffer[TEMP_BUFFER_SIZE];
 
-				int decompress_result = tjDecompress2(decompressor_handle, active_frame->frame_data,
-					(active_frame->expected_packet_count - 1) * DATA_PACKET_DATA_SIZE + active_frame->last_packet_data_size,
-					local_decompress_buffer, SCREEN_HEIGHT[packet.is_top], SCREEN_HEIGHT[packet.is_top] * 4,
-					SCREEN_WIDTH[packet.is_top], TJPF_RGBA, 0);
+	for (int job_index = 0; job_index < job_count; job_index++)
+	{
+		struct ntr_crop_job *job = &jobs[job_index];
+		int image_width = transforms[job_index].r.w;
+		int image_height = transforms[job_index].r.h;
 
-				pthread_mutex_lock(&connection_data->buffer_mutex[packet.is_top]);
-				memcpy(connection_data->uncompressed_buffer[packet.is_top], local_decompress_buffer, SCREEN_WIDTH[packet.is_top] * SCREEN_HEIGHT[packet.is_top] * 4);
-				connection_data->last_frame_id[packet.is_top] = packet.id;
-				pthread_mutex_unlock(&connection_data->buffer_mutex[packet.is_top]);
-			}
-		}
-		else
+		if (tjDecompress2(crop_decompressor_handle, crop_jpeg_data[job_index], crop_jpeg_size[job_index],
+			local_image_buffer, image_width, image_width * 4, image_height, TJPF_RGBA, 0) != 0)
 		{
-			uint64_t elapsed_ns_since_last_read = obs_get_video_frame_time() - last_read_time;
-
-			if (elapsed_ns_since_last_read >= DATA_SOCKET_TIMEOUT_DURATION_NS)
-			{
-				blog(LOG_WARNING, "obs-ntr: Data socket received no data after %d ms; probably not active", elapsed_ns_since_last_read / 1000000);
-				break;
-			}
+			continue;
 		}
-		// It seems to be critical to our packet loss rate to wait for a non-zero duration here,
-		// probably so the OS has adequate time to populate the socket's buffer. Note that I'm
-		// passing 2, because the Windows implementation reduces the value by 1 for some reason. 
-		os_sleep_ms(2);
-	}
 
-	for (int frame_index = 0; frame_index < CONCURRENT_FRAMES; frame_index++)
-	{
-		bfree(frames[frame_index].frame_data);
-	}
-
-	tjDestroy(decompressor_handle);
-
-	closesocket(data_socket);
-	connection_data->net_thread_exited = true;
+		pthread_mutex_lock(&crop_regions_mutex);
 
-	return 0;
+		// The region may have been released, or even reused for another one, while this was decoding.
+		struct ntr_crop_region *target = job->target;
+		if (target->refs > 0 && target->screen == job->region.screen && target->left == job->region.left &&
+			target->top == job->region.top && target->width == job->region.width && target->height == job->region.height)
+		{
+			memcpy(target->image_data, local_image_buffer, image_width * image_height * 4);
+			target->image_width = image_width;
+			target->image_height = image_height;
+			target->offset_x = job->region.offset_x;
+			target->offset_y = job->region.offset_y;
+			target->sequence++;
+		}
 
-exception:
-	if (data_socket != INVALID_SOCKET)
-	{
-		closesocket(data_socket);
+		pthread_mutex_unlock(&crop_regions_mutex);
 	}
-
-	connection_data->net_thread_exited = true;
-	return (void *)1;
 }
 
-static struct ntr_data *connection_owner = NULL;
-static struct ntr_connection_data *shared_connection_data = NULL;
-
 void obs_ntr_connection_create(struct ntr_data *owner_data)
 {
-	struct ntr_connection_data *temp_connection_data = bzalloc(sizeof(struct ntr_connection_data));
+	struct ntr_connection_data *temp_connection_data = obs_ntr_connection_alloc();
+
+	temp_connection_data->stream_decode = owner_data->connection_setup.stream_decode;
+	temp_connection_data->priority_factor = owner_data->connection_setup.priority_factor;
+	temp_connection_data->priority_screen = owner_data->connection_setup.priority_screen;
+	temp_connection_data->stats = &connection_stats;
+	temp_connection_data->replay_buffers = replay_buffers;
+	temp_connection_data->decode_demand = screen_show_count;
+	temp_connection_data->compressed_demand = cropped_show_count;
+	temp_connection_data->frame_received = obs_ntr_crop_frame_received;
+
+	crop_transform_handle = tjInitTransform();
+	crop_decompressor_handle = tjInitDecompress();
+
+	// Frames are rotated, so the largest is SCREEN_HEIGHT wide.
+	crop_jpeg_capacity = tjBufSize(SCREEN_HEIGHT[SCREEN_TOP], SCREEN_WIDTH[SCREEN_TOP], TJSAMP_444);
+	for (int region_index = 0; region_index < MAX_CROP_REGIONS; region_index++)
+	{
+		crop_jpeg_data[region_index] = tjAlloc((int)crop_jpeg_capacity);
+	}
 
-	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	if (!dstr_is_empty(&owner_data->connection_setup.stats_file_path))
 	{
-		temp_connection_data->uncompressed_buffer[screen_index] = bzalloc(SCREEN_WIDTH[screen_index] * SCREEN_HEIGHT[screen_index] * 4);
+		stats_file_writer.stats = &connection_stats;
+		dstr_copy_dstr(&stats_file_writer.path, &owner_data->connection_setup.stats_file_path);
+		os_event_init(&stats_file_writer.stop_event, OS_EVENT_TYPE_MANUAL);
+		pthread_create(&stats_file_writer.thread, NULL, obs_ntr_stats_file_thread_run, &stats_file_writer);
+	}
 
-		pthread_mutex_init_value(&temp_connection_data->buffer_mutex[screen_index]);
-		pthread_mutex_init(&temp_connection_data->buffer_mutex[screen_index], NULL);
+	if (!dstr_is_empty(&owner_data->connection_setup.trace_file_path))
+	{
+		trace_file = obs_ntr_trace_create(owner_data->connection_setup.trace_file_path.array, &owner_data->connection_setup);
+		temp_connection_data->trace_file = trace_file;
 	}
 
 	shared_connection_data = temp_connection_data;
 
-	shared_connection_data->net_thread_exited = false;
-	shared_connection_data->net_thread_started = true;
-	pthread_create(&shared_connection_data->net_thread, NULL, obs_ntr_net_thread_run, shared_connection_data);
+	obs_ntr_connection_start(shared_connection_data);
 }
 
 void obs_ntr_connection_destroy()
@@ -480,16 +490,36 @@ void obs_ntr_connection_destroy()
 
 	if (temp_connection_data != NULL)
 	{
-		temp_connection_data->disconnect_requested = true;
-		pthread_join(temp_connection_data->net_thread, NULL);
+		obs_ntr_connection_free(temp_connection_data);
 
-		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		if (stats_file_writer.stop_event != NULL)
+		{
+			os_event_signal(stats_file_writer.stop_event);
+			pthread_join(stats_file_writer.thread, NULL);
+			os_event_destroy(stats_file_writer.stop_event);
+			stats_file_writer.stop_event = NULL;
+		}
+
+		dstr_free(&stats_file_writer.path);
+
+		if (trace_file != NULL)
 		{
-			pthread_mutex_destroy(&temp_connection_data->buffer_mutex[screen_index]);
-			bfree(temp_connection_data->uncompressed_buffer[screen_index]);
+			fclose(trace_file);
+			trace_file = NULL;
 		}
 
-		bfree(temp_connection_data);
+		tjDestroy(crop_transform_handle);
+		tjDestroy(crop_decompressor_handle);
+		crop_transform_handle = NULL;
+		crop_decompressor_handle = NULL;
+
+		for (int region_index = 0; region_index < MAX_CROP_REGIONS; region_index++)
+		{
+			tjFree(crop_jpeg_data[region_index]);
+			crop_jpeg_data[region_index] = NULL;
+			crop_jpeg_size[region_index] = 0;
+		}
+		crop_jpeg_capacity = 0;
 	}
 }
 
@@ -532,6 +562,56 @@ static void obs_ntr_set_debug_text(struct ntr_data *context, const char *text)
 	}
 }
 
+static bool obs_ntr_is_cropped(struct ntr_data *context)
+{
+	return context->crop_width < SCREEN_WIDTH[context->screen] || context->crop_height < SCREEN_HEIGHT[context->screen];
+}
+
+// Keeps screen_show_count and cropped_show_count in step with whether this source is showing, which
+// screen it shows, and whether it's cropped, and holds on to its crop region while it's showing. The
+// video tick reads crop_region, so it only changes with crop_regions_mutex held.
+static void obs_ntr_update_show_count(struct ntr_data *context)
+{
+	bool cropped = obs_ntr_is_cropped(context);
+	bool region_changed = context->crop_region != NULL && !obs_ntr_crop_region_matches(context->crop_region, context);
+
+	if (context->counted_showing && (!context->showing || context->counted_screen != context->screen || context->counted_cropped != cropped ||
+		region_changed))
+	{
+		os_atomic_dec_long(context->counted_cropped ? &cropped_show_count[context->counted_screen] : &screen_show_count[context->counted_screen]);
+		context->counted_showing = false;
+
+		if (context->crop_region != NULL)
+		{
+			pthread_mutex_lock(&crop_regions_mutex);
+			obs_ntr_crop_region_release(context->crop_region);
+			context->crop_region = NULL;
+			pthread_mutex_unlock(&crop_regions_mutex);
+		}
+	}
+
+	if (context->showing && !context->counted_showing)
+	{
+		if (cropped)
+		{
+			pthread_mutex_lock(&crop_regions_mutex);
+			context->crop_region = obs_ntr_crop_region_acquire(context);
+			context->crop_sequence = -1;
+			pthread_mutex_unlock(&crop_regions_mutex);
+
+			if (context->crop_region == NULL)
+			{
+				blog(LOG_WARNING, "obs-ntr: Too many different cropped regions shown at once; showing at most %d", MAX_CROP_REGIONS);
+			}
+		}
+
+		os_atomic_inc_long(cropped ? &cropped_show_count[context->screen] : &screen_show_count[context->screen]);
+		context->counted_showing = true;
+		context->counted_cropped = cropped;
+		context->counted_screen = context->screen;
+	}
+}
+
 static void obs_ntr_destroy(void *data)
 {
 	struct ntr_data *context = data;
@@ -541,15 +621,37 @@ static void obs_ntr_destroy(void *data)
 		obs_ntr_connection_destroy();
 	}
 
+	if (connection_owner == context)
+	{
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			obs_ntr_replay_buffer_set_duration(&replay_buffers[screen_index], 0);
+		}
+	}
+
+	context->showing = false;
+	obs_ntr_update_show_count(context);
+
 	if (context->debug_text_source != NULL)
 	{
 		obs_source_release(context->debug_text_source);
 	}
 
-	if (context->texture != NULL)
+	if (context->crop_texture != NULL)
 	{
 		obs_enter_graphics();
-		gs_texture_destroy(context->texture);
+		gs_texture_destroy(context->crop_texture);
+		obs_leave_graphics();
+	}
+
+	dstr_free(&context->connection_setup.ip_address);
+	dstr_free(&context->connection_setup.stats_file_path);
+	dstr_free(&context->connection_setup.trace_file_path);
+
+	if (context->holds_screen_texture)
+	{
+		obs_enter_graphics();
+		obs_ntr_screen_texture_release(context->screen);
 		obs_leave_graphics();
 	}
 
@@ -623,7 +725,13 @@ static obs_properties_t *obs_ntr_properties(void *data)
 	obs_property_list_add_int(screen_prop, obs_module_text("Ntr.Screen.Top"), SCREEN_TOP);
 	obs_property_list_add_int(screen_prop, obs_module_text("Ntr.Screen.Bottom"), SCREEN_BOTTOM);
 
+	obs_properties_add_int(props, "crop_left", obs_module_text("Ntr.CropLeft"), 0, 399, 1);
+	obs_properties_add_int(props, "crop_top", obs_module_text("Ntr.CropTop"), 0, 239, 1);
+	obs_properties_add_int(props, "crop_width", obs_module_text("Ntr.CropWidth"), 0, 400, 1);
+	obs_properties_add_int(props, "crop_height", obs_module_text("Ntr.CropHeight"), 0, 240, 1);
+
 	obs_properties_add_bool(props, "show_stats", obs_module_text("Ntr.ShowStats"));
+	obs_properties_add_bool(props, "show_frame_graph", obs_module_text("Ntr.ShowFrameGraph"));
 
 	if (context == connection_owner)
 	{
@@ -645,6 +753,14 @@ static obs_properties_t *obs_ntr_properties(void *data)
 		obs_property_t *priority_screen_prop = obs_properties_add_list(props, "priority_screen", obs_module_text("Ntr.PriorityScreen"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
 		obs_property_list_add_int(priority_screen_prop, obs_module_text("Ntr.Screen.Top"), SCREEN_TOP);
 		obs_property_list_add_int(priority_screen_prop, obs_module_text("Ntr.Screen.Bottom"), SCREEN_BOTTOM);
+
+		obs_properties_add_bool(props, "stream_decode", obs_module_text("Ntr.StreamDecode"));
+
+		obs_properties_add_int(props, "replay_seconds", obs_module_text("Ntr.ReplaySeconds"), 0, 120, 1);
+
+		obs_properties_add_path(props, "stats_file", obs_module_text("Ntr.StatsFile"), OBS_PATH_FILE_SAVE, "JSON (*.json)", NULL);
+
+		obs_properties_add_path(props, "trace_file", obs_module_text("Ntr.TraceFile"), OBS_PATH_FILE_SAVE, "NTR packet trace (*.ntrtrace)", NULL);
 	}
 	else
 	{
@@ -662,13 +778,42 @@ static void obs_ntr_update(void *data, obs_data_t *settings)
 	enum ntr_screen old_screen = context->screen;
 	context->screen = obs_data_get_int(settings, "screen");
 
+	context->crop_left = (int)obs_data_get_int(settings, "crop_left");
+	context->crop_top = (int)obs_data_get_int(settings, "crop_top");
+	if (context->crop_left >= SCREEN_WIDTH[context->screen])
+	{
+		context->crop_left = SCREEN_WIDTH[context->screen] - 1;
+	}
+	if (context->crop_top >= SCREEN_HEIGHT[context->screen])
+	{
+		context->crop_top = SCREEN_HEIGHT[context->screen] - 1;
+	}
+
+	context->crop_width = (int)obs_data_get_int(settings, "crop_width");
+	context->crop_height = (int)obs_data_get_int(settings, "crop_height");
+	if (context->crop_width <= 0 || context->crop_left + context->crop_width > SCREEN_WIDTH[context->screen])
+	{
+		context->crop_width = SCREEN_WIDTH[context->screen] - context->crop_left;
+	}
+	if (context->crop_height <= 0 || context->crop_top + context->crop_height > SCREEN_HEIGHT[context->screen])
+	{
+		context->crop_height = SCREEN_HEIGHT[context->screen] - context->crop_top;
+	}
+
+	obs_ntr_update_show_count(context);
+
 	dstr_copy(&context->connection_setup.ip_address, obs_data_get_string(settings, "ip_address"));
 	context->connection_setup.quality = (int)obs_data_get_int(settings, "quality");
 	context->connection_setup.qos = (int)obs_data_get_int(settings, "qos");
 	context->connection_setup.priority_factor = (int)obs_data_get_int(settings, "priority_factor");
 	context->connection_setup.priority_screen = (int)obs_data_get_int(settings, "priority_screen");
+	context->connection_setup.stream_decode = obs_data_get_bool(settings, "stream_decode");
+	dstr_copy(&context->connection_setup.stats_file_path, obs_data_get_string(settings, "stats_file"));
+	dstr_copy(&context->connection_setup.trace_file_path, obs_data_get_string(settings, "trace_file"));
+	context->connection_setup.replay_seconds = (int)obs_data_get_int(settings, "replay_seconds");
 
 	context->show_stats = obs_data_get_bool(settings, "show_stats");
+	context->show_frame_graph = obs_data_get_bool(settings, "show_frame_graph");
 
 	if (context->show_stats && context->debug_text_source == NULL)
 	{
@@ -702,16 +847,26 @@ static void obs_ntr_update(void *data, obs_data_t *settings)
 		connection_owner = NULL;
 	}
 
-	if (old_screen != context->screen || context->texture == NULL)
+	// Only the owner has the replay length setting; everyone else just has the default.
+	if (context == connection_owner)
+	{
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			obs_ntr_replay_buffer_set_duration(&replay_buffers[screen_index], context->connection_setup.replay_seconds);
+		}
+	}
+
+	if (old_screen != context->screen || !context->holds_screen_texture)
 	{
 		obs_enter_graphics();
 
-		if (context->texture != NULL)
+		if (context->holds_screen_texture)
 		{
-			gs_texture_destroy(context->texture);
+			obs_ntr_screen_texture_release(old_screen);
 		}
 
-		context->texture = gs_texture_create(SCREEN_HEIGHT[context->screen], SCREEN_WIDTH[context->screen], GS_RGBA, 1, NULL, GS_DYNAMIC);
+		obs_ntr_screen_texture_acquire(context->screen);
+		context->holds_screen_texture = true;
 
 		obs_leave_graphics();
 	}
@@ -753,18 +908,30 @@ static void obs_ntr_update(void *data, obs_data_t *settings)
 
 			char dropped_percent_buffer[8];
 			char fps_buffer[8];
+			char decode_buffer[8];
+			char overlapped_decode_buffer[8];
+			char receive_slots_buffer[8];
+
+			// Each source shows the stats for its own screen.
+			int screen = context->screen;
 
 			float dropped_percent = 0.0f;
-			if (shared_connection_data->total_processed_frames > 0)
+			if (shared_connection_data->total_processed_frames[screen] > 0)
 			{
-				dropped_percent = ((float)shared_connection_data->dropped_frames * 100.0f / shared_connection_data->total_processed_frames);
+				dropped_percent = ((float)shared_connection_data->dropped_frames[screen] * 100.0f / shared_connection_data->total_processed_frames[screen]);
 			}
 
 			snprintf(dropped_percent_buffer, 8, "%.0f", dropped_percent);
-			snprintf(fps_buffer, 8, "%.1f", shared_connection_data->fps);
+			snprintf(fps_buffer, 8, "%.1f", shared_connection_data->fps[screen]);
+			snprintf(decode_buffer, 8, "%.1f", shared_connection_data->decode_ms[screen]);
+			snprintf(overlapped_decode_buffer, 8, "%.1f", shared_connection_data->overlapped_decode_ms[screen]);
+			snprintf(receive_slots_buffer, 8, "%d", shared_connection_data->receive_slots[screen]);
 
 			dstr_replace(&buffer, "%1", dropped_percent_buffer);
 			dstr_replace(&buffer, "%2", fps_buffer);
+			dstr_replace(&buffer, "%3", decode_buffer);
+			dstr_replace(&buffer, "%4", overlapped_decode_buffer);
+			dstr_replace(&buffer, "%5", receive_slots_buffer);
 
 			obs_ntr_set_debug_text(context, buffer.array);
 
@@ -775,6 +942,53 @@ static void obs_ntr_update(void *data, obs_data_t *settings)
 	}
 }
 
+// Uploads the newest decode of this source's crop region, if it has changed since the last one.
+static void obs_ntr_upload_cropped(struct ntr_data *context)
+{
+	unsigned char local_image_buffer[TEMP_BUFFER_SIZE];
+
+	pthread_mutex_lock(&crop_regions_mutex);
+
+	// The source may be shown or hidden on another thread, which changes its region.
+	struct ntr_crop_region *region = context->crop_region;
+	if (region == NULL || region->refs == 0 || region->image_data == NULL || region->sequence == context->crop_sequence)
+	{
+		pthread_mutex_unlock(&crop_regions_mutex);
+		return;
+	}
+
+	context->crop_sequence = region->sequence;
+	int image_width = region->image_width;
+	int image_height = region->image_height;
+	context->crop_offset_x = region->offset_x;
+	context->crop_offset_y = region->offset_y;
+	memcpy(local_image_buffer, region->image_data, image_width * image_height * 4);
+	pthread_mutex_unlock(&crop_regions_mutex);
+
+	if (image_width == 0)
+	{
+		return;
+	}
+
+	obs_enter_graphics();
+
+	if (context->crop_texture == NULL || context->crop_texture_width != image_width || context->crop_texture_height != image_height)
+	{
+		if (context->crop_texture != NULL)
+		{
+			gs_texture_destroy(context->crop_texture);
+		}
+
+		context->crop_texture = gs_texture_create(image_width, image_height, GS_RGBA, 1, NULL, GS_DYNAMIC);
+		context->crop_texture_width = image_width;
+		context->crop_texture_height = image_height;
+	}
+
+	gs_texture_set_image(context->crop_texture, local_image_buffer, image_width * 4, false);
+
+	obs_leave_graphics();
+}
+
 static void obs_ntr_tick(void *data, float seconds)
 {
 	struct ntr_data *context = data;
@@ -787,22 +1001,10 @@ static void obs_ntr_tick(void *data, float seconds)
 		obs_source_update(context->source, NULL);
 	}
 
+	obs_ntr_upload_cropped(context);
+
 	if (shared_connection_data != NULL)
 	{
-		if (shared_connection_data->last_frame_id[context->screen] != context->last_frame_id)
-		{
-			char local_image_buffer[TEMP_BUFFER_SIZE];
-
-			pthread_mutex_lock(&shared_connection_data->buffer_mutex[context->screen]);
-			context->last_frame_id = shared_connection_data->last_frame_id[context->screen];
-			memcpy(local_image_buffer, shared_connection_data->uncompressed_buffer[context->screen], SCREEN_WIDTH[context->screen] * SCREEN_HEIGHT[context->screen] * 4);
-			pthread_mutex_unlock(&shared_connection_data->buffer_mutex[context->screen]);
-
-			obs_enter_graphics();
-			gs_texture_set_image(context->texture, local_image_buffer, SCREEN_HEIGHT[context->screen] * 4, false);
-			obs_leave_graphics();
-		}
-
 		if (context->debug_text_source != NULL && shared_connection_data->last_stat_time != context->last_stat_time)
 		{
 			context->last_stat_time = shared_connection_data->last_stat_time;
@@ -821,24 +1023,157 @@ static void obs_ntr_tick(void *data, float seconds)
 	}
 }
 
-static void obs_ntr_render(void *data, gs_effect_t *effect)
+static void obs_ntr_show(void *data)
 {
-	UNUSED_PARAMETER(effect);
+	struct ntr_data *context = data;
 
+	context->showing = true;
+	obs_ntr_update_show_count(context);
+}
+
+static void obs_ntr_hide(void *data)
+{
 	struct ntr_data *context = data;
 
-	if (context->texture != NULL)
+	context->showing = false;
+	obs_ntr_update_show_count(context);
+}
+
+#define FRAME_GRAPH_HEIGHT 64.0f
+#define FRAME_GRAPH_MAX_MS 100.0f
+
+static float obs_ntr_frame_graph_y(float bottom, float ms)
+{
+	return bottom - FRAME_GRAPH_HEIGHT * (ms < FRAME_GRAPH_MAX_MS ? ms : FRAME_GRAPH_MAX_MS) / FRAME_GRAPH_MAX_MS;
+}
+
+// Draws the most recent frame intervals (green) and latencies (yellow) as a scrolling graph along the
+// bottom of the source, with a red marker for each dropped frame. The faint lines mark 60 and 30 fps.
+static void obs_ntr_render_frame_graph(struct ntr_frame_graph *graph, float width, float height)
+{
+	long sample_count = os_atomic_load_long(&graph->sample_count);
+	int visible_count = sample_count < FRAME_GRAPH_SAMPLE_COUNT ? sample_count : FRAME_GRAPH_SAMPLE_COUNT;
+	float step = width / FRAME_GRAPH_SAMPLE_COUNT;
+	float left = width - visible_count * step;
+
+	gs_effect_t *solid = obs_get_base_effect(OBS_EFFECT_SOLID);
+	gs_eparam_t *color = gs_effect_get_param_by_name(solid, "color");
+
+	while (gs_effect_loop(solid, "Solid"))
 	{
-		gs_effect_set_texture(gs_effect_get_param_by_name(effect, "image"),
-			context->texture);
+		gs_effect_set_color(color, 0x60FFFFFF);
+		gs_render_start(true);
+		gs_vertex2f(0.0f, obs_ntr_frame_graph_y(height, 1000.0f / 60.0f));
+		gs_vertex2f(width, obs_ntr_frame_graph_y(height, 1000.0f / 60.0f));
+		gs_vertex2f(0.0f, obs_ntr_frame_graph_y(height, 1000.0f / 30.0f));
+		gs_vertex2f(width, obs_ntr_frame_graph_y(height, 1000.0f / 30.0f));
+		gs_render_stop(GS_LINES);
+
+		if (visible_count < 2)
+		{
+			continue;
+		}
+
+		gs_effect_set_color(color, 0xFF00FF00);
+		gs_render_start(true);
+		for (int sample_index = 0; sample_index < visible_count; sample_index++)
+		{
+			struct ntr_frame_graph_sample *sample = &graph->samples[(sample_count - visible_count + sample_index) % FRAME_GRAPH_SAMPLE_COUNT];
+			gs_vertex2f(left + sample_index * step, obs_ntr_frame_graph_y(height, sample->interval_ms));
+		}
+		gs_render_stop(GS_LINESTRIP);
 
+		gs_effect_set_color(color, 0xFFFFFF00);
+		gs_render_start(true);
+		for (int sample_index = 0; sample_index < visible_count; sample_index++)
+		{
+			struct ntr_frame_graph_sample *sample = &graph->samples[(sample_count - visible_count + sample_index) % FRAME_GRAPH_SAMPLE_COUNT];
+			if (!sample->dropped)
+			{
+				gs_vertex2f(left + sample_index * step, obs_ntr_frame_graph_y(height, sample->latency_ms));
+			}
+		}
+		gs_render_stop(GS_LINESTRIP);
+
+		gs_effect_set_color(color, 0xFFFF0000);
+		gs_render_start(true);
+		for (int sample_index = 0; sample_index < visible_count; sample_index++)
+		{
+			struct ntr_frame_graph_sample *sample = &graph->samples[(sample_count - visible_count + sample_index) % FRAME_GRAPH_SAMPLE_COUNT];
+			if (sample->dropped)
+			{
+				gs_vertex2f(left + sample_index * step, height);
+				gs_vertex2f(left + sample_index * step, height - FRAME_GRAPH_HEIGHT);
+			}
+		}
+		gs_render_stop(GS_LINES);
+	}
+}
+
+// Draws a decoded frame upright. Frames from NTR are rotated, so the texture is SCREEN_HEIGHT
+// pixels wide and SCREEN_WIDTH pixels tall.
+static void obs_ntr_draw_screen_texture(gs_texture_t *texture, enum ntr_screen screen)
+{
+	gs_effect_t *default_effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	gs_effect_set_texture(gs_effect_get_param_by_name(default_effect, "image"),
+		texture);
+
+	while (gs_effect_loop(default_effect, "Draw"))
+	{
 		gs_matrix_push();
-		gs_matrix_translate3f(0.0f, (float)SCREEN_HEIGHT[context->screen], 0.0f);
+		gs_matrix_translate3f(0.0f, (float)SCREEN_HEIGHT[screen], 0.0f);
 		gs_matrix_rotaa4f(0.0f, 0.0f, 1.0f, RAD(-90.0f));
-		gs_draw_sprite(context->texture, 0,
-			SCREEN_HEIGHT[context->screen], SCREEN_WIDTH[context->screen]);
+		gs_draw_sprite(texture, 0,
+			SCREEN_HEIGHT[screen], SCREEN_WIDTH[screen]);
 		gs_matrix_pop();
 	}
+}
+
+static void obs_ntr_draw_cropped_texture(struct ntr_data *context)
+{
+	gs_effect_t *default_effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	gs_effect_set_texture(gs_effect_get_param_by_name(default_effect, "image"),
+		context->crop_texture);
+
+	while (gs_effect_loop(default_effect, "Draw"))
+	{
+		gs_matrix_push();
+		gs_matrix_translate3f(0.0f, (float)context->crop_height, 0.0f);
+		gs_matrix_rotaa4f(0.0f, 0.0f, 1.0f, RAD(-90.0f));
+		gs_draw_sprite_subregion(context->crop_texture, 0, context->crop_offset_x, context->crop_offset_y,
+			context->crop_height, context->crop_width);
+		gs_matrix_pop();
+	}
+}
+
+static void obs_ntr_render(void *data, gs_effect_t *effect)
+{
+	UNUSED_PARAMETER(effect);
+
+	struct ntr_data *context = data;
+
+	if (obs_ntr_is_cropped(context))
+	{
+		if (context->crop_texture != NULL)
+		{
+			obs_ntr_draw_cropped_texture(context);
+		}
+	}
+	else
+	{
+		gs_texture_t *texture = screen_textures[context->screen].texture;
+
+		if (texture != NULL)
+		{
+			obs_ntr_draw_screen_texture(texture, context->screen);
+		}
+	}
+
+	if (context->show_frame_graph)
+	{
+		obs_ntr_render_frame_graph(&connection_stats.frame_graphs[context->screen],
+			(float)context->crop_width, (float)context->crop_height);
+	}
 
 	if (context->debug_text_source != NULL)
 	{
@@ -851,14 +1186,14 @@ static uint32_t obs_ntr_getwidth(void *data)
 {
 	struct ntr_data *context = data;
 
-	return SCREEN_WIDTH[context->screen];
+	return context->crop_width;
 }
 
 static uint32_t obs_ntr_getheight(void *data)
 {
 	struct ntr_data *context = data;
 
-	return SCREEN_HEIGHT[context->screen];
+	return context->crop_height;
 }
 
 static void obs_ntr_defaults(obs_data_t *settings)
@@ -867,22 +1202,42 @@ static void obs_ntr_defaults(obs_data_t *settings)
 
 	obs_data_set_default_int(settings, "screen", SCREEN_TOP);
 
+	obs_data_set_default_int(settings, "crop_left", 0);
+	obs_data_set_default_int(settings, "crop_top", 0);
+	obs_data_set_default_int(settings, "crop_width", 0);
+	obs_data_set_default_int(settings, "crop_height", 0);
+
 	obs_data_set_default_bool(settings, "show_stats", false);
+	obs_data_set_default_bool(settings, "show_frame_graph", false);
 
 	obs_data_set_default_int(settings, "quality", 80);
 	obs_data_set_default_int(settings, "priority_factor", 2);
 	obs_data_set_default_int(settings, "qos", 100);
 	obs_data_set_default_int(settings, "priority_screen", SCREEN_TOP);
+
+	obs_data_set_default_bool(settings, "stream_decode", true);
+	obs_data_set_default_int(settings, "replay_seconds", 0);
+}
+
+static void obs_ntr_proc_get_stats(void *data, calldata_t *params)
+{
+	UNUSED_PARAMETER(data);
+
+	obs_data_t *snapshot = obs_ntr_stats_snapshot(&connection_stats);
+	calldata_set_string(params, "json", obs_data_get_json(snapshot));
+	obs_data_release(snapshot);
 }
 
 struct obs_source_info obs_ntr_source = {
 	.id                  = "obs_ntr",
 	.type                = OBS_SOURCE_TYPE_INPUT,
-	.output_flags        = OBS_SOURCE_VIDEO,
+	.output_flags        = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW,
 	.create              = obs_ntr_create,
 	.destroy             = obs_ntr_destroy,
 	.enum_active_sources = obs_ntr_enum_sources,
 	.update              = obs_ntr_update,
+	.show                = obs_ntr_show,
+	.hide                = obs_ntr_hide,
 	.video_tick          = obs_ntr_tick,
 	.get_name            = obs_ntr_get_name,
 	.get_defaults        = obs_ntr_defaults,
@@ -892,16 +1247,330 @@ struct obs_source_info obs_ntr_source = {
 	.get_properties      = obs_ntr_properties
 };
 
+// A companion source that plays back the replay buffer for one screen, decoding frames on demand.
+struct ntr_replay_data
+{
+	obs_source_t *source;
+
+	enum ntr_screen screen;
+	int speed_percent;
+	bool replay_on_activate;
+
+	bool replay_requested;
+	bool pause_requested;
+	bool step_requested;
+
+	bool playing;
+	bool paused;
+	uint64_t position;
+	uint64_t end_position;
+	uint64_t displayed_timestamp;
+
+	tjhandle decompressor_handle;
+	unsigned char *frame_data;
+	int frame_data_capacity;
+	unsigned char *image_data;
+
+	gs_texture_t *texture;
+	enum ntr_screen texture_screen;
+};
+
+static const char *obs_ntr_replay_get_name(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("NtrReplay");
+}
+
+static void *obs_ntr_replay_create(obs_data_t *settings, obs_source_t *source)
+{
+	struct ntr_replay_data *context = bzalloc(sizeof(struct ntr_replay_data));
+	context->source = source;
+
+	context->decompressor_handle = tjInitDecompress();
+	context->image_data = bzalloc(TEMP_BUFFER_SIZE);
+
+	obs_source_update(source, settings);
+
+	return context;
+}
+
+static void obs_ntr_replay_destroy(void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	if (context->texture != NULL)
+	{
+		obs_enter_graphics();
+		gs_texture_destroy(context->texture);
+		obs_leave_graphics();
+	}
+
+	tjDestroy(context->decompressor_handle);
+	bfree(context->frame_data);
+	bfree(context->image_data);
+	bfree(context);
+}
+
+bool replay_start_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	context->replay_requested = true;
+
+	return false;
+}
+
+bool replay_pause_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	context->pause_requested = true;
+
+	return false;
+}
+
+bool replay_step_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	context->step_requested = true;
+
+	return false;
+}
+
+static obs_properties_t *obs_ntr_replay_properties(void *data)
+{
+	UNUSED_PARAMETER(data);
+
+	obs_properties_t *props = obs_properties_create();
+
+	obs_property_t *screen_prop = obs_properties_add_list(props, "screen", obs_module_text("Ntr.Screen"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(screen_prop, obs_module_text("Ntr.Screen.Top"), SCREEN_TOP);
+	obs_property_list_add_int(screen_prop, obs_module_text("Ntr.Screen.Bottom"), SCREEN_BOTTOM);
+
+	obs_property_t *speed_prop = obs_properties_add_list(props, "speed", obs_module_text("NtrReplay.Speed"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(speed_prop, "1x", 100);
+	obs_property_list_add_int(speed_prop, "0.5x", 50);
+	obs_property_list_add_int(speed_prop, "0.25x", 25);
+
+	obs_properties_add_bool(props, "replay_on_activate", obs_module_text("NtrReplay.ReplayOnActivate"));
+
+	obs_properties_add_button(props, "replay_start", obs_module_text("NtrReplay.Start"), replay_start_clicked);
+	obs_properties_add_button(props, "replay_pause", obs_module_text("NtrReplay.Pause"), replay_pause_clicked);
+	obs_properties_add_button(props, "replay_step", obs_module_text("NtrReplay.Step"), replay_step_clicked);
+
+	return props;
+}
+
+static void obs_ntr_replay_update(void *data, obs_data_t *settings)
+{
+	struct ntr_replay_data *context = data;
+
+	context->screen = obs_data_get_int(settings, "screen");
+	context->speed_percent = (int)obs_data_get_int(settings, "speed");
+	context->replay_on_activate = obs_data_get_bool(settings, "replay_on_activate");
+}
+
+static void obs_ntr_replay_activate(void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	if (context->replay_on_activate)
+	{
+		context->replay_requested = true;
+	}
+}
+
+// Copies out and decodes the frame at the given index of the replay buffer, if it isn't already
+// the one being displayed. Must be called with the buffer's mutex held.
+static bool obs_ntr_replay_load_frame(struct ntr_replay_data *context, struct ntr_replay_buffer *buffer, long frame_index)
+{
+	struct ntr_replay_frame *frame = obs_ntr_replay_buffer_get(buffer, frame_index);
+
+	if (frame->timestamp == context->displayed_timestamp)
+	{
+		return false;
+	}
+
+	if (frame->size > context->frame_data_capacity)
+	{
+		context->frame_data = brealloc(context->frame_data, frame->size);
+		context->frame_data_capacity = frame->size;
+	}
+
+	memcpy(context->frame_data, buffer->data + frame->offset, frame->size);
+	context->displayed_timestamp = frame->timestamp;
+
+	return true;
+}
+
+static void obs_ntr_replay_tick(void *data, float seconds)
+{
+	struct ntr_replay_data *context = data;
+	struct ntr_replay_buffer *buffer = &replay_buffers[context->screen];
+
+	bool new_frame = false;
+	int frame_size = 0;
+
+	pthread_mutex_lock(&buffer->mutex);
+
+	if (context->replay_requested)
+	{
+		context->replay_requested = false;
+
+		if (buffer->frame_count > 0)
+		{
+			context->playing = true;
+			context->paused = false;
+			context->position = obs_ntr_replay_buffer_get(buffer, 0)->timestamp;
+			context->end_position = obs_ntr_replay_buffer_get(buffer, (long)buffer->frame_count - 1)->timestamp;
+			context->displayed_timestamp = 0;
+		}
+	}
+
+	if (context->pause_requested)
+	{
+		context->pause_requested = false;
+		context->paused = !context->paused;
+	}
+
+	if (context->playing && !context->paused)
+	{
+		context->position += (uint64_t)(seconds * 1000000000.0 * context->speed_percent / 100.0);
+		if (context->position >= context->end_position)
+		{
+			// Hold the last frame once the replay catches up to where it was started.
+			context->position = context->end_position;
+			context->playing = false;
+		}
+	}
+	else if (context->step_requested)
+	{
+		long frame_index = obs_ntr_replay_buffer_find(buffer, context->displayed_timestamp);
+		if (frame_index + 1 < (long)buffer->frame_count)
+		{
+			context->position = obs_ntr_replay_buffer_get(buffer, frame_index + 1)->timestamp;
+		}
+	}
+	context->step_requested = false;
+
+	long frame_index = obs_ntr_replay_buffer_find(buffer, context->position);
+	if (frame_index < 0 && buffer->frame_count > 0)
+	{
+		// The frame we were on has already aged out of the buffer.
+		frame_index = 0;
+	}
+
+	if (frame_index >= 0 && context->position > 0)
+	{
+		new_frame = obs_ntr_replay_load_frame(context, buffer, frame_index);
+		frame_size = obs_ntr_replay_buffer_get(buffer, frame_index)->size;
+	}
+
+	pthread_mutex_unlock(&buffer->mutex);
+
+	if (new_frame && obs_ntr_decode_image(context->decompressor_handle, context->screen, context->frame_data, frame_size, context->image_data))
+	{
+		obs_enter_graphics();
+
+		if (context->texture == NULL || context->texture_screen != context->screen)
+		{
+			if (context->texture != NULL)
+			{
+				gs_texture_destroy(context->texture);
+			}
+
+			context->texture = gs_texture_create(SCREEN_HEIGHT[context->screen], SCREEN_WIDTH[context->screen], GS_RGBA, 1, NULL, GS_DYNAMIC);
+			context->texture_screen = context->screen;
+		}
+
+		gs_texture_set_image(context->texture, context->image_data, SCREEN_HEIGHT[context->screen] * 4, false);
+
+		obs_leave_graphics();
+	}
+}
+
+static void obs_ntr_replay_render(void *data, gs_effect_t *effect)
+{
+	UNUSED_PARAMETER(effect);
+
+	struct ntr_replay_data *context = data;
+
+	if (context->texture != NULL && context->texture_screen == context->screen)
+	{
+		obs_ntr_draw_screen_texture(context->texture, context->screen);
+	}
+}
+
+static uint32_t obs_ntr_replay_getwidth(void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	return SCREEN_WIDTH[context->screen];
+}
+
+static uint32_t obs_ntr_replay_getheight(void *data)
+{
+	struct ntr_replay_data *context = data;
+
+	return SCREEN_HEIGHT[context->screen];
+}
+
+static void obs_ntr_replay_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_int(settings, "screen", SCREEN_TOP);
+	obs_data_set_default_int(settings, "speed", 100);
+	obs_data_set_default_bool(settings, "replay_on_activate", true);
+}
+
+struct obs_source_info obs_ntr_replay_source = {
+	.id                  = "obs_ntr_replay",
+	.type                = OBS_SOURCE_TYPE_INPUT,
+	.output_flags        = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW,
+	.create              = obs_ntr_replay_create,
+	.destroy             = obs_ntr_replay_destroy,
+	.update              = obs_ntr_replay_update,
+	.activate            = obs_ntr_replay_activate,
+	.video_tick          = obs_ntr_replay_tick,
+	.get_name            = obs_ntr_replay_get_name,
+	.get_defaults        = obs_ntr_replay_defaults,
+	.get_width           = obs_ntr_replay_getwidth,
+	.get_height          = obs_ntr_replay_getheight,
+	.video_render        = obs_ntr_replay_render,
+	.get_properties      = obs_ntr_replay_properties
+};
+
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-ntr", "en-US")
 
 bool obs_module_load(void)
 {
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		obs_ntr_replay_buffer_init(&replay_buffers[screen_index], &connection_stats.screens[screen_index]);
+	}
+
+	pthread_mutex_init_value(&crop_regions_mutex);
+	pthread_mutex_init(&crop_regions_mutex, NULL);
+
 	obs_register_source(&obs_ntr_source);
+	obs_register_source(&obs_ntr_replay_source);
+
+	obs_add_tick_callback(obs_ntr_upload_tick, NULL);
+
+	proc_handler_add(obs_get_proc_handler(), "void obs_ntr_get_stats(out string json)", obs_ntr_proc_get_stats, NULL);
 
 	return true;
 }
 
 void obs_module_unload(void)
 {
+	obs_remove_tick_callback(obs_ntr_upload_tick, NULL);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		obs_ntr_replay_buffer_free(&replay_buffers[screen_index]);
+	}
+
+	pthread_mutex_destroy(&crop_regions_mutex);
 }
@@ -0,0 +1,943 @@
+// ntr-advisor: reads a packet trace recorded by obs-ntr or ntr-receive, and estimates the frame rate,
+// drop rate and latency each screen would get with other picture quality, quality of service and
+// priority factor settings. Since NTR can only be reconfigured by rebooting the 3DS, this lets one
+// recorded session stand in for trying each combination.
+//
+// The model works on "rounds" of frames: NTR sends priority_factor frames of the priority screen for
+// each frame of the other screen.
+//  - Frame sizes at other qualities come from re-encoding a sample of the recorded frames, scaled so
+//    that re-encoding at the recorded quality matches what NTR actually sent.
+//  - NTR sends rounds no faster than the slowest of its own encoder (the recorded frame rate, unless
+//    something else was the limit), the QoS cap (in Mbit/s; above 100 means no cap), and the receiver,
+//    which reads one packet at a time (at the recorded spacing between packets within a frame) and
+//    then decodes each frame (timed here).
+//  - Packet loss scales with the packet rate from what was recorded, and a frame is dropped if any of
+//    its packets is lost, using the distribution of packets per frame at that quality.
+// It's a rough model, so the recorded settings are put through it as well to show how close it gets.
+//
+//     ntr-advisor capture.ntrtrace --min-fps 30 --max-drop 5
+
+#include "ntr-connection.h"
+#include "ntr-trace.h"
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/darray.h>
+#include <util/platform.h>
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int QUALITY_LEVELS[] = { 10, 20, 30, 40, 50, 60, 70, 75, 80, 85, 90, 95, 100 };
+#define QUALITY_LEVEL_COUNT (sizeof(QUALITY_LEVELS) / sizeof(QUALITY_LEVELS[0]))
+
+// The recorded quality gets an extra level of its own after the fixed ones.
+#define RECORDED_QUALITY_LEVEL QUALITY_LEVEL_COUNT
+
+static const int QOS_LEVELS[] = { 5, 10, 15, 20, 30, 50, 101 };
+#define QOS_LEVEL_COUNT (sizeof(QOS_LEVELS) / sizeof(QOS_LEVELS[0]))
+
+#define MAX_PRIORITY_FACTOR 5
+#define SAMPLE_FRAMES_PER_SCREEN 100
+#define CANDIDATES_SHOWN 10
+
+// A frame that hasn't had a packet for this long is finished, complete or not.
+#define FRAME_TIMEOUT_NS 200000000
+
+struct open_frame
+{
+	bool open;
+	uint64_t first_packet_time;
+	uint64_t last_packet_time;
+	uint64_t finished_time;
+	int packet_count;
+	int expected_packet_count;
+	int highest_order;
+	int last_packet_data_size;
+	uint64_t received_mask;
+	unsigned char *frame_data;
+};
+
+struct screen_profile
+{
+	long frames_completed;
+	long frames_dropped;
+	long packets_received;
+	long packets_lost;
+	uint64_t bytes_received;
+
+	DARRAY(int) frame_sizes;
+	DARRAY(double) packet_intervals_ms;
+
+	// From re-encoding a sample of the completed frames.
+	int sample_count;
+	int subsampling;
+	double size_ratio[QUALITY_LEVEL_COUNT + 1];
+	double decode_ms[QUALITY_LEVEL_COUNT + 1];
+	double recorded_decode_ms;
+
+	// Over all completed frames, scaled to each quality.
+	double mean_packets[QUALITY_LEVEL_COUNT + 1];
+	double mean_bytes[QUALITY_LEVEL_COUNT + 1];
+	long packet_histogram[QUALITY_LEVEL_COUNT + 1][DATA_PACKET_MAX_COUNT + 1];
+};
+
+struct trace_profile
+{
+	struct ntr_trace_header header;
+	int qualities[QUALITY_LEVEL_COUNT + 1];
+
+	uint64_t first_packet_time;
+	uint64_t last_packet_time;
+	double duration_seconds;
+
+	double packet_interval_ms;
+	double packet_loss;
+	double packets_per_second;
+	double mbits_per_second;
+	double frames_per_second;
+	double source_fps;
+	const char *recorded_limit;
+	bool source_fps_measured;
+
+	struct screen_profile screens[SCREEN_COUNT];
+};
+
+struct model_result
+{
+	int quality_level;
+	int qos;
+	int priority_factor;
+
+	double fps[SCREEN_COUNT];
+	double drop_rate[SCREEN_COUNT];
+	double latency_ms[SCREEN_COUNT];
+	double mbits_per_second;
+	const char *limit;
+};
+
+// Called with each completed frame as the trace is read.
+typedef void (*frame_handler_t)(void *param, enum ntr_screen screen, long frame_index, const struct open_frame *frame, int frame_size);
+
+static void log_to_stderr(int log_level, const char *format, va_list args, void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (log_level <= LOG_INFO)
+	{
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+	}
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double first = *(const double *)a;
+	double second = *(const double *)b;
+	return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+static double median(double *values, size_t count)
+{
+	if (count == 0)
+	{
+		return 0.0;
+	}
+
+	qsort(values, count, sizeof(double), compare_doubles);
+	return count % 2 == 1 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+static void finish_frame(struct trace_profile *profile, enum ntr_screen screen, struct open_frame *frame, uint64_t now,
+	frame_handler_t handler, void *param)
+{
+	struct screen_profile *screen_profile = &profile->screens[screen];
+	bool complete = frame->expected_packet_count > 0 && frame->packet_count >= frame->expected_packet_count;
+
+	if (complete)
+	{
+		int frame_size = (frame->expected_packet_count - 1) * DATA_PACKET_DATA_SIZE + frame->last_packet_data_size;
+
+		if (handler != NULL)
+		{
+			handler(param, screen, screen_profile->frames_completed, frame, frame_size);
+		}
+
+		screen_profile->frames_completed++;
+	}
+	else
+	{
+		// As in the receiver, a frame whose last packet never showed up is assumed to be missing
+		// at least that one.
+		int frame_packet_total = frame->expected_packet_count > 0 ? frame->expected_packet_count : frame->highest_order + 2;
+		screen_profile->frames_dropped++;
+		screen_profile->packets_lost += frame_packet_total - frame->packet_count;
+	}
+
+	frame->open = false;
+	frame->finished_time = now;
+	bfree(frame->frame_data);
+	frame->frame_data = NULL;
+}
+
+// Reassembles every frame in the trace. Unlike the receiver, nothing here is limited to a few
+// frames in flight, so frames are only lost when their packets were.
+static bool read_trace(const char *path, struct trace_profile *profile, frame_handler_t handler, void *param)
+{
+	FILE *trace_file = obs_ntr_trace_open(path, &profile->header);
+	if (trace_file == NULL)
+	{
+		return false;
+	}
+
+	struct open_frame (*frames)[256] = bzalloc(sizeof(struct open_frame) * 256 * SCREEN_COUNT);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		struct screen_profile *screen_profile = &profile->screens[screen_index];
+		screen_profile->frames_completed = 0;
+		screen_profile->frames_dropped = 0;
+		screen_profile->packets_received = 0;
+		screen_profile->packets_lost = 0;
+		screen_profile->bytes_received = 0;
+	}
+
+	uint64_t timestamp = 0;
+	struct ntr_data_packet packet;
+	int packet_size;
+	bool first_packet = true;
+
+	while (obs_ntr_trace_read_packet(trace_file, &timestamp, &packet, &packet_size))
+	{
+		if (first_packet)
+		{
+			profile->first_packet_time = timestamp;
+			first_packet = false;
+		}
+		profile->last_packet_time = timestamp;
+
+		for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+		{
+			for (int id = 0; id < 256; id++)
+			{
+				struct open_frame *frame = &frames[screen_index][id];
+				if (frame->open && timestamp - frame->last_packet_time >= FRAME_TIMEOUT_NS)
+				{
+					finish_frame(profile, screen_index, frame, timestamp, handler, param);
+				}
+			}
+		}
+
+		if (packet_size <= 4 || packet.order >= DATA_PACKET_MAX_COUNT)
+		{
+			continue;
+		}
+
+		struct open_frame *frame = &frames[packet.is_top][packet.id];
+		uint64_t packet_bit = 1ULL << packet.order;
+
+		if (!frame->open)
+		{
+			if (frame->finished_time != 0 && timestamp - frame->finished_time < FRAME_TIMEOUT_NS)
+			{
+				// A straggler or duplicate for a frame that's already been counted.
+				continue;
+			}
+
+			memset(frame, 0, sizeof(struct open_frame));
+			frame->open = true;
+			frame->first_packet_time = timestamp;
+			frame->highest_order = -1;
+			frame->frame_data = bmalloc(DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT);
+		}
+		else if ((frame->received_mask & packet_bit) != 0)
+		{
+			continue;
+		}
+
+		profile->screens[packet.is_top].packets_received++;
+
+		frame->last_packet_time = timestamp;
+		frame->received_mask |= packet_bit;
+		frame->packet_count++;
+		if (packet.order > frame->highest_order)
+		{
+			frame->highest_order = packet.order;
+		}
+
+		int data_size = packet_size - 4;
+		profile->screens[packet.is_top].bytes_received += data_size;
+		if (packet.is_last)
+		{
+			frame->expected_packet_count = packet.order + 1;
+			frame->last_packet_data_size = data_size;
+		}
+		memcpy(frame->frame_data + DATA_PACKET_DATA_SIZE * packet.order, packet.data, data_size);
+
+		if (frame->expected_packet_count > 0 && frame->packet_count >= frame->expected_packet_count)
+		{
+			finish_frame(profile, packet.is_top, frame, timestamp, handler, param);
+		}
+	}
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		for (int id = 0; id < 256; id++)
+		{
+			if (frames[screen_index][id].open)
+			{
+				finish_frame(profile, screen_index, &frames[screen_index][id], timestamp, handler, param);
+			}
+		}
+	}
+
+	bfree(frames);
+	fclose(trace_file);
+	return true;
+}
+
+static void measure_frame(void *param, enum ntr_screen screen, long frame_index, const struct open_frame *frame, int frame_size)
+{
+	struct screen_profile *screen_profile = &((struct trace_profile *)param)->screens[screen];
+	UNUSED_PARAMETER(frame_index);
+
+	da_push_back(screen_profile->frame_sizes, &frame_size);
+
+	if (frame->packet_count > 1)
+	{
+		double interval_ms = (frame->last_packet_time - frame->first_packet_time) / 1000000.0 / (frame->packet_count - 1);
+		da_push_back(screen_profile->packet_intervals_ms, &interval_ms);
+	}
+}
+
+struct frame_sampler
+{
+	struct trace_profile *profile;
+	long stride[SCREEN_COUNT];
+	tjhandle compressor_handle;
+	tjhandle decompressor_handle;
+	unsigned char *image_data;
+	unsigned char *decoded_data;
+};
+
+static double time_decode_ms(struct frame_sampler *sampler, enum ntr_screen screen, const unsigned char *frame_data, unsigned long frame_size)
+{
+	uint64_t start_time = os_gettime_ns();
+	obs_ntr_decode_image(sampler->decompressor_handle, screen, frame_data, (int)frame_size, sampler->decoded_data);
+	return (os_gettime_ns() - start_time) / 1000000.0;
+}
+
+static unsigned long compress_size(struct frame_sampler *sampler, enum ntr_screen screen, int quality, int subsampling,
+	unsigned char **compressed_data)
+{
+	// A size of 0 makes tjCompress2 allocate a new buffer, so let go of the previous one first.
+	tjFree(*compressed_data);
+	*compressed_data = NULL;
+	unsigned long compressed_size = 0;
+
+	// Decoded frames are rotated, so the image is SCREEN_HEIGHT wide.
+	if (tjCompress2(sampler->compressor_handle, sampler->image_data, SCREEN_HEIGHT[screen], SCREEN_HEIGHT[screen] * 4,
+		SCREEN_WIDTH[screen], TJPF_RGBA, compressed_data, &compressed_size, subsampling, quality, TJFLAG_FASTDCT) != 0)
+	{
+		return 0;
+	}
+
+	return compressed_size;
+}
+
+// Re-encodes a completed frame at each quality level, comparing the sizes against re-encoding at
+// the recorded quality, and times decoding each version.
+static void sample_frame(void *param, enum ntr_screen screen, long frame_index, const struct open_frame *frame, int frame_size)
+{
+	struct frame_sampler *sampler = param;
+	struct screen_profile *screen_profile = &sampler->profile->screens[screen];
+
+	if (frame_index % sampler->stride[screen] != 0)
+	{
+		return;
+	}
+
+	int width;
+	int height;
+	int subsampling;
+	int colorspace;
+	if (tjDecompressHeader3(sampler->decompressor_handle, frame->frame_data, frame_size, &width, &height, &subsampling, &colorspace) != 0 ||
+		width != SCREEN_HEIGHT[screen] || height != SCREEN_WIDTH[screen])
+	{
+		return;
+	}
+
+	screen_profile->subsampling = subsampling;
+	screen_profile->recorded_decode_ms += time_decode_ms(sampler, screen, frame->frame_data, frame_size);
+	if (!obs_ntr_decode_image(sampler->decompressor_handle, screen, frame->frame_data, frame_size, sampler->image_data))
+	{
+		return;
+	}
+
+	unsigned char *compressed_data = NULL;
+	unsigned long recorded_quality_size = compress_size(sampler, screen, sampler->profile->qualities[RECORDED_QUALITY_LEVEL], subsampling,
+		&compressed_data);
+	if (recorded_quality_size == 0)
+	{
+		tjFree(compressed_data);
+		return;
+	}
+
+	for (size_t level = 0; level <= QUALITY_LEVEL_COUNT; level++)
+	{
+		unsigned long compressed_size = compress_size(sampler, screen, sampler->profile->qualities[level], subsampling, &compressed_data);
+		screen_profile->size_ratio[level] += (double)compressed_size / recorded_quality_size;
+		screen_profile->decode_ms[level] += time_decode_ms(sampler, screen, compressed_data, compressed_size);
+	}
+
+	tjFree(compressed_data);
+	screen_profile->sample_count++;
+}
+
+static void summarize_screen(struct trace_profile *profile, enum ntr_screen screen)
+{
+	struct screen_profile *screen_profile = &profile->screens[screen];
+
+	if (screen_profile->sample_count > 0)
+	{
+		screen_profile->recorded_decode_ms /= screen_profile->sample_count;
+		for (size_t level = 0; level <= QUALITY_LEVEL_COUNT; level++)
+		{
+			screen_profile->size_ratio[level] /= screen_profile->sample_count;
+			screen_profile->decode_ms[level] /= screen_profile->sample_count;
+		}
+	}
+	else
+	{
+		for (size_t level = 0; level <= QUALITY_LEVEL_COUNT; level++)
+		{
+			screen_profile->size_ratio[level] = 1.0;
+		}
+	}
+
+	for (size_t level = 0; level <= QUALITY_LEVEL_COUNT; level++)
+	{
+		double total_packets = 0.0;
+		double total_bytes = 0.0;
+
+		for (size_t frame_index = 0; frame_index < screen_profile->frame_sizes.num; frame_index++)
+		{
+			double scaled_size = screen_profile->frame_sizes.array[frame_index] * screen_profile->size_ratio[level];
+			int packet_count = (int)ceil(scaled_size / DATA_PACKET_DATA_SIZE);
+			if (packet_count < 1)
+			{
+				packet_count = 1;
+			}
+			else if (packet_count > DATA_PACKET_MAX_COUNT)
+			{
+				packet_count = DATA_PACKET_MAX_COUNT;
+			}
+
+			screen_profile->packet_histogram[level][packet_count]++;
+			total_packets += packet_count;
+			total_bytes += scaled_size;
+		}
+
+		if (screen_profile->frame_sizes.num > 0)
+		{
+			screen_profile->mean_packets[level] = total_packets / screen_profile->frame_sizes.num;
+			screen_profile->mean_bytes[level] = total_bytes / screen_profile->frame_sizes.num;
+		}
+	}
+}
+
+// Frames of each screen per round.
+static void round_shares(int priority_factor, enum ntr_screen priority_screen, double *shares)
+{
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		shares[screen_index] = screen_index == (int)priority_screen ? (priority_factor > 0 ? priority_factor : 1) : (priority_factor > 0 ? 1 : 0);
+	}
+}
+
+static void run_model(const struct trace_profile *profile, int quality_level, int qos, int priority_factor, enum ntr_screen priority_screen,
+	struct model_result *result)
+{
+	double shares[SCREEN_COUNT];
+	round_shares(priority_factor, priority_screen, shares);
+
+	double round_frames = 0.0;
+	double round_bytes = 0.0;
+	double round_packets = 0.0;
+	double round_receive_ms = 0.0;
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		const struct screen_profile *screen_profile = &profile->screens[screen_index];
+
+		round_frames += shares[screen_index];
+		round_bytes += shares[screen_index] * screen_profile->mean_bytes[quality_level];
+		round_packets += shares[screen_index] * screen_profile->mean_packets[quality_level];
+		round_receive_ms += shares[screen_index] * (screen_profile->mean_packets[quality_level] * profile->packet_interval_ms +
+			screen_profile->decode_ms[quality_level]);
+	}
+
+	double rounds_per_second = profile->source_fps / round_frames;
+	result->limit = "3DS";
+
+	if (qos <= 100 && round_bytes > 0.0)
+	{
+		double qos_rounds_per_second = qos * 1024.0 * 1024.0 / 8.0 / round_bytes;
+		if (qos_rounds_per_second < rounds_per_second)
+		{
+			rounds_per_second = qos_rounds_per_second;
+			result->limit = "QoS";
+		}
+	}
+
+	if (round_receive_ms > 0.0 && 1000.0 / round_receive_ms < rounds_per_second)
+	{
+		rounds_per_second = 1000.0 / round_receive_ms;
+		result->limit = "receiver";
+	}
+
+	double packet_loss = 0.0;
+	if (profile->packets_per_second > 0.0)
+	{
+		packet_loss = profile->packet_loss * (rounds_per_second * round_packets) / profile->packets_per_second;
+		if (packet_loss > 0.9)
+		{
+			packet_loss = 0.9;
+		}
+	}
+
+	result->quality_level = quality_level;
+	result->qos = qos;
+	result->priority_factor = priority_factor;
+	result->mbits_per_second = rounds_per_second * round_bytes * 8.0 / (1024.0 * 1024.0);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		const struct screen_profile *screen_profile = &profile->screens[screen_index];
+
+		double frames = 0.0;
+		double dropped = 0.0;
+		for (int packet_count = 1; packet_count <= DATA_PACKET_MAX_COUNT; packet_count++)
+		{
+			long histogram_count = screen_profile->packet_histogram[quality_level][packet_count];
+			frames += histogram_count;
+			dropped += histogram_count * (1.0 - pow(1.0 - packet_loss, packet_count));
+		}
+
+		result->drop_rate[screen_index] = frames > 0.0 ? dropped / frames : 0.0;
+		result->fps[screen_index] = rounds_per_second * shares[screen_index] * (1.0 - result->drop_rate[screen_index]);
+		result->latency_ms[screen_index] = screen_profile->mean_packets[quality_level] * profile->packet_interval_ms +
+			screen_profile->decode_ms[quality_level];
+	}
+}
+
+// The steps below which differences in the estimates are ignored when ranking candidates.
+#define RANK_FPS_STEP 0.5
+#define RANK_DROP_STEP 0.005
+#define RANK_LATENCY_STEP_MS 0.1
+
+static long rank_step(double value, double step)
+{
+	return (long)floor(value / step);
+}
+
+// Whether a meets the targets better than b: first whichever meets them, then higher quality, then
+// more frames of the other screen, then lower latency. If neither meets them, more frames of the
+// priority screen and then fewer drops come before all of that. Anything still tied prefers the
+// higher QoS limit, which leaves the most headroom, and then the lower priority factor. The
+// estimates are compared in steps rather than by how far apart they are, so this is a proper
+// ordering and the best candidate doesn't depend on the order they were tried in.
+static bool is_better(const struct trace_profile *profile, const struct model_result *a, const struct model_result *b,
+	enum ntr_screen priority_screen, double min_fps, double max_drop)
+{
+	enum ntr_screen other_screen = priority_screen == SCREEN_TOP ? SCREEN_BOTTOM : SCREEN_TOP;
+
+	double a_worst_drop = a->drop_rate[SCREEN_TOP] > a->drop_rate[SCREEN_BOTTOM] ? a->drop_rate[SCREEN_TOP] : a->drop_rate[SCREEN_BOTTOM];
+	double b_worst_drop = b->drop_rate[SCREEN_TOP] > b->drop_rate[SCREEN_BOTTOM] ? b->drop_rate[SCREEN_TOP] : b->drop_rate[SCREEN_BOTTOM];
+
+	bool a_meets = a->fps[priority_screen] >= min_fps && a_worst_drop <= max_drop;
+	bool b_meets = b->fps[priority_screen] >= min_fps && b_worst_drop <= max_drop;
+
+	if (a_meets != b_meets)
+	{
+		return a_meets;
+	}
+
+	if (!a_meets)
+	{
+		long a_fps = rank_step(a->fps[priority_screen], RANK_FPS_STEP);
+		long b_fps = rank_step(b->fps[priority_screen], RANK_FPS_STEP);
+		if (a_fps != b_fps)
+		{
+			return a_fps > b_fps;
+		}
+
+		long a_drop = rank_step(a_worst_drop, RANK_DROP_STEP);
+		long b_drop = rank_step(b_worst_drop, RANK_DROP_STEP);
+		if (a_drop != b_drop)
+		{
+			return a_drop < b_drop;
+		}
+	}
+
+	int a_quality = profile->qualities[a->quality_level];
+	int b_quality = profile->qualities[b->quality_level];
+	if (a_quality != b_quality)
+	{
+		return a_quality > b_quality;
+	}
+
+	long a_other_fps = rank_step(a->fps[other_screen], RANK_FPS_STEP);
+	long b_other_fps = rank_step(b->fps[other_screen], RANK_FPS_STEP);
+	if (a_other_fps != b_other_fps)
+	{
+		return a_other_fps > b_other_fps;
+	}
+
+	long a_latency = rank_step(a->latency_ms[priority_screen], RANK_LATENCY_STEP_MS);
+	long b_latency = rank_step(b->latency_ms[priority_screen], RANK_LATENCY_STEP_MS);
+	if (a_latency != b_latency)
+	{
+		return a_latency < b_latency;
+	}
+
+	if (a->qos != b->qos)
+	{
+		return a->qos > b->qos;
+	}
+
+	return a->priority_factor < b->priority_factor;
+}
+
+static const char *screen_name(enum ntr_screen screen)
+{
+	return screen == SCREEN_TOP ? "top" : "bottom";
+}
+
+static void print_result_header(void)
+{
+	printf("  quality  qos  factor | top fps  drop  latency | bottom fps  drop  latency | Mbit/s  limited by\n");
+}
+
+static void print_result(const struct trace_profile *profile, const struct model_result *result)
+{
+	printf("  %7d  %3d  %6d | %7.1f %4.1f%% %6.1fms | %10.1f %4.1f%% %6.1fms | %6.1f  %s\n",
+		profile->qualities[result->quality_level], result->qos, result->priority_factor,
+		result->fps[SCREEN_TOP], result->drop_rate[SCREEN_TOP] * 100.0, result->latency_ms[SCREEN_TOP],
+		result->fps[SCREEN_BOTTOM], result->drop_rate[SCREEN_BOTTOM] * 100.0, result->latency_ms[SCREEN_BOTTOM],
+		result->mbits_per_second, result->limit);
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"usage: ntr-advisor <trace> [options]\n"
+		"\n"
+		"  --min-fps <fps>            frame rate wanted for the priority screen (default 30)\n"
+		"  --max-drop <percent>       highest acceptable share of frames dropped on either screen (default 5)\n"
+		"  --priority-screen <screen> top or bottom (default: as recorded)\n"
+		"  --source-fps <fps>         frames per second NTR can encode, across both screens, if the trace\n"
+		"                             doesn't show it (default 60)\n"
+		"\n"
+		"The settings NTR was started with are read from the trace. If it was started by some other\n"
+		"program, override them with --quality, --qos and --priority-factor.\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *trace_path = NULL;
+	double min_fps = 30.0;
+	double max_drop = 0.05;
+	double assumed_source_fps = 60.0;
+	int priority_screen_override = -1;
+	int quality_override = -1;
+	int qos_override = -1;
+	int priority_factor_override = -1;
+
+	for (int arg_index = 1; arg_index < argc; arg_index++)
+	{
+		const char *arg = argv[arg_index];
+		const char *value = arg_index + 1 < argc ? argv[arg_index + 1] : NULL;
+
+		if (arg[0] != '-' && trace_path == NULL)
+		{
+			trace_path = arg;
+			continue;
+		}
+		else if (value == NULL)
+		{
+			print_usage();
+			return 1;
+		}
+		else if (strcmp(arg, "--min-fps") == 0)
+		{
+			min_fps = atof(value);
+		}
+		else if (strcmp(arg, "--max-drop") == 0)
+		{
+			max_drop = atof(value) / 100.0;
+		}
+		else if (strcmp(arg, "--source-fps") == 0)
+		{
+			assumed_source_fps = atof(value);
+		}
+		else if (strcmp(arg, "--priority-screen") == 0 && strcmp(value, "top") == 0)
+		{
+			priority_screen_override = SCREEN_TOP;
+		}
+		else if (strcmp(arg, "--priority-screen") == 0 && strcmp(value, "bottom") == 0)
+		{
+			priority_screen_override = SCREEN_BOTTOM;
+		}
+		else if (strcmp(arg, "--quality") == 0)
+		{
+			quality_override = atoi(value);
+		}
+		else if (strcmp(arg, "--qos") == 0)
+		{
+			qos_override = atoi(value);
+		}
+		else if (strcmp(arg, "--priority-factor") == 0)
+		{
+			priority_factor_override = atoi(value);
+		}
+		else
+		{
+			print_usage();
+			return 1;
+		}
+
+		arg_index++;
+	}
+
+	if (trace_path == NULL)
+	{
+		print_usage();
+		return 1;
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+	struct trace_profile *profile = bzalloc(sizeof(struct trace_profile));
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		da_init(profile->screens[screen_index].frame_sizes);
+		da_init(profile->screens[screen_index].packet_intervals_ms);
+	}
+
+	if (!read_trace(trace_path, profile, measure_frame, profile))
+	{
+		return 1;
+	}
+
+	if (quality_override >= 0)
+	{
+		profile->header.quality = quality_override;
+	}
+	if (qos_override >= 0)
+	{
+		profile->header.qos = qos_override;
+	}
+	if (priority_factor_override >= 0)
+	{
+		profile->header.priority_factor = priority_factor_override;
+	}
+
+	enum ntr_screen priority_screen = priority_screen_override >= 0 ? (enum ntr_screen)priority_screen_override : profile->header.priority_screen;
+
+	for (size_t level = 0; level < QUALITY_LEVEL_COUNT; level++)
+	{
+		profile->qualities[level] = QUALITY_LEVELS[level];
+	}
+	profile->qualities[RECORDED_QUALITY_LEVEL] = profile->header.quality;
+
+	// Overall rates and loss.
+	profile->duration_seconds = (profile->last_packet_time - profile->first_packet_time) / 1000000000.0;
+	if (profile->duration_seconds <= 0.0 || profile->screens[SCREEN_TOP].frames_completed + profile->screens[SCREEN_BOTTOM].frames_completed == 0)
+	{
+		blog(LOG_ERROR, "ntr-advisor: %s doesn't contain any complete frames", trace_path);
+		return 1;
+	}
+
+	long packets_received = 0;
+	long packets_lost = 0;
+	long frames_sent = 0;
+	uint64_t bytes_received = 0;
+	DARRAY(double) all_packet_intervals;
+	da_init(all_packet_intervals);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		struct screen_profile *screen_profile = &profile->screens[screen_index];
+		packets_received += screen_profile->packets_received;
+		packets_lost += screen_profile->packets_lost;
+		frames_sent += screen_profile->frames_completed + screen_profile->frames_dropped;
+		bytes_received += screen_profile->bytes_received;
+
+		for (size_t interval_index = 0; interval_index < screen_profile->packet_intervals_ms.num; interval_index++)
+		{
+			da_push_back(all_packet_intervals, &screen_profile->packet_intervals_ms.array[interval_index]);
+		}
+	}
+
+	profile->packet_loss = (double)packets_lost / (packets_received + packets_lost);
+	profile->packets_per_second = (packets_received + packets_lost) / profile->duration_seconds;
+	profile->mbits_per_second = (double)bytes_received * 8.0 / (1024.0 * 1024.0) / profile->duration_seconds;
+	profile->frames_per_second = frames_sent / profile->duration_seconds;
+	profile->packet_interval_ms = median(all_packet_intervals.array, all_packet_intervals.num);
+	da_free(all_packet_intervals);
+
+	// If either QoS or the receiver was the bottleneck, the trace can't say how fast NTR could have
+	// encoded frames otherwise.
+	if (profile->header.qos <= 100 && profile->mbits_per_second >= profile->header.qos * 0.9)
+	{
+		profile->recorded_limit = "QoS";
+	}
+	else if (profile->packet_interval_ms > 0.0 && profile->packets_per_second >= 1000.0 / profile->packet_interval_ms * 0.9)
+	{
+		profile->recorded_limit = "receiver";
+	}
+	else
+	{
+		profile->recorded_limit = "3DS";
+	}
+
+	profile->source_fps_measured = strcmp(profile->recorded_limit, "3DS") == 0;
+	if (profile->source_fps_measured || profile->frames_per_second > assumed_source_fps)
+	{
+		profile->source_fps = profile->frames_per_second;
+	}
+	else
+	{
+		profile->source_fps = assumed_source_fps;
+	}
+
+	// Re-encode a sample of frames from each screen.
+	struct frame_sampler sampler;
+	sampler.profile = profile;
+	sampler.compressor_handle = tjInitCompress();
+	sampler.decompressor_handle = tjInitDecompress();
+	sampler.image_data = bmalloc(TEMP_BUFFER_SIZE);
+	sampler.decoded_data = bmalloc(TEMP_BUFFER_SIZE);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		long frames_completed = profile->screens[screen_index].frames_completed;
+		sampler.stride[screen_index] = frames_completed > SAMPLE_FRAMES_PER_SCREEN ? frames_completed / SAMPLE_FRAMES_PER_SCREEN : 1;
+	}
+
+	// Reading the trace again also reads its header again, which would undo any overrides.
+	struct ntr_trace_header header = profile->header;
+	blog(LOG_INFO, "ntr-advisor: Re-encoding sample frames...");
+	read_trace(trace_path, profile, sample_frame, &sampler);
+	profile->header = header;
+
+	tjDestroy(sampler.compressor_handle);
+	tjDestroy(sampler.decompressor_handle);
+	bfree(sampler.image_data);
+	bfree(sampler.decoded_data);
+
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		summarize_screen(profile, screen_index);
+	}
+
+	// What was recorded.
+	printf("Trace: %.1f seconds, recorded with quality %d, QoS %d, priority factor %d (%s)\n\n",
+		profile->duration_seconds, profile->header.quality, profile->header.qos, profile->header.priority_factor,
+		screen_name(profile->header.priority_screen));
+
+	printf("                            top    bottom\n");
+	printf("  frames sent/s        %8.1f  %8.1f\n",
+		(profile->screens[SCREEN_TOP].frames_completed + profile->screens[SCREEN_TOP].frames_dropped) / profile->duration_seconds,
+		(profile->screens[SCREEN_BOTTOM].frames_completed + profile->screens[SCREEN_BOTTOM].frames_dropped) / profile->duration_seconds);
+	printf("  frames completed/s   %8.1f  %8.1f\n",
+		profile->screens[SCREEN_TOP].frames_completed / profile->duration_seconds,
+		profile->screens[SCREEN_BOTTOM].frames_completed / profile->duration_seconds);
+	printf("  packets per frame    %8.1f  %8.1f\n",
+		profile->screens[SCREEN_TOP].mean_packets[RECORDED_QUALITY_LEVEL], profile->screens[SCREEN_BOTTOM].mean_packets[RECORDED_QUALITY_LEVEL]);
+	printf("  decode time (ms)     %8.2f  %8.2f\n",
+		profile->screens[SCREEN_TOP].recorded_decode_ms, profile->screens[SCREEN_BOTTOM].recorded_decode_ms);
+	printf("\n  packet loss %.2f%%, %.1f Mbit/s, %.2f ms between packets within a frame, limited by %s\n\n",
+		profile->packet_loss * 100.0, profile->mbits_per_second, profile->packet_interval_ms, profile->recorded_limit);
+
+	if (!profile->source_fps_measured)
+	{
+		printf("  NTR's own frame rate isn't visible in this trace; assuming %.0f frames/s (see --source-fps).\n\n", profile->source_fps);
+	}
+
+	struct model_result recorded_result;
+	run_model(profile, RECORDED_QUALITY_LEVEL, profile->header.qos, profile->header.priority_factor, profile->header.priority_screen, &recorded_result);
+
+	printf("Modeled with the recorded settings, for comparison:\n");
+	print_result_header();
+	print_result(profile, &recorded_result);
+	printf("\n");
+
+	// Try every combination.
+	DARRAY(struct model_result) results;
+	da_init(results);
+
+	for (size_t level = 0; level < QUALITY_LEVEL_COUNT; level++)
+	{
+		for (size_t qos_index = 0; qos_index < QOS_LEVEL_COUNT; qos_index++)
+		{
+			for (int priority_factor = 1; priority_factor <= MAX_PRIORITY_FACTOR; priority_factor++)
+			{
+				struct model_result result;
+				run_model(profile, (int)level, QOS_LEVELS[qos_index], priority_factor, priority_screen, &result);
+				da_push_back(results, &result);
+			}
+		}
+	}
+
+	// Selection sort is plenty for a few hundred candidates.
+	for (size_t result_index = 0; result_index < results.num && result_index < CANDIDATES_SHOWN; result_index++)
+	{
+		size_t best_index = result_index;
+		for (size_t other_index = result_index + 1; other_index < results.num; other_index++)
+		{
+			if (is_better(profile, &results.array[other_index], &results.array[best_index], priority_screen, min_fps, max_drop))
+			{
+				best_index = other_index;
+			}
+		}
+
+		struct model_result swap = results.array[result_index];
+		results.array[result_index] = results.array[best_index];
+		results.array[best_index] = swap;
+	}
+
+	printf("Best candidates for at least %.0f fps on the %s screen with at most %.0f%% of frames dropped:\n",
+		min_fps, screen_name(priority_screen), max_drop * 100.0);
+	print_result_header();
+	for (size_t result_index = 0; result_index < results.num && result_index < CANDIDATES_SHOWN; result_index++)
+	{
+		print_result(profile, &results.array[result_index]);
+	}
+
+	struct model_result *best = &results.array[0];
+	bool meets_targets = best->fps[priority_screen] >= min_fps && best->drop_rate[SCREEN_TOP] <= max_drop && best->drop_rate[SCREEN_BOTTOM] <= max_drop;
+
+	printf("\n%s\n", meets_targets ? "Recommended connection settings:" :
+		"No combination meets the targets; these give the priority screen the highest frame rate:");
+	printf("  Picture Quality      %d\n", profile->qualities[best->quality_level]);
+	printf("  Quality of Service   %d\n", best->qos);
+	printf("  Priority Screen      %s\n", priority_screen == SCREEN_TOP ? "Top" : "Bottom");
+	printf("  Priority Factor      %d\n", best->priority_factor);
+	printf("\n  ntr-receive --quality %d --qos %d --priority-screen %s --priority-factor %d\n",
+		profile->qualities[best->quality_level], best->qos, screen_name(priority_screen), best->priority_factor);
+
+	da_free(results);
+	for (int screen_index = 0; screen_index < SCREEN_COUNT; screen_index++)
+	{
+		da_free(profile->screens[screen_index].frame_sizes);
+		da_free(profile->screens[screen_index].packet_intervals_ms);
+	}
+	bfree(profile);
+
+	return 0;
+}
@@ -0,0 +1,615 @@
+// ntr-receive: receives NTR's remote view stream without OBS, and writes one screen's frames to
+// stdout or a file/named pipe, either as raw video or as the JPEG frames NTR sent.
+//
+// For example, to show the top screen with ffplay:
+//
+//     ntr-receive --ip 192.168.1.20 --format rgba | ffplay -f rawvideo -pixel_format rgba -video_size 400x240 -
+//
+// The network thread hands each frame to a separate writer thread, which does any conversion and
+// writes it with the output unbuffered. Decoded images are handed over in the buffer they were
+// decoded into, and JPEG frames are copied once out of the reassembly slot, so the network thread
+// does no more per frame than it has to. With --low-latency, a frame that the writer hasn't picked
+// up by the time the next one is ready is dropped, rather than making the network thread wait (and
+// lose packets) for a slow consumer.
+
+#include "ntr-connection.h"
+#include "ntr-trace.h"
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+enum output_format
+{
+	OUTPUT_RGBA,
+	OUTPUT_YUV420P,
+	OUTPUT_MJPEG
+};
+
+struct receiver
+{
+	FILE *output;
+	enum output_format format;
+	enum ntr_screen screen;
+	bool low_latency;
+
+	pthread_t writer_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	// Three buffers rotate between the network thread (back), the handoff (pending), and the
+	// writer thread (front), so a frame is never copied on its way to the writer. For decoded
+	// formats, back is also exchanged with the connection for each image it decodes.
+	unsigned char *back;
+	unsigned char *pending;
+	unsigned char *front;
+
+	// Where the writer thread converts decoded images to the output format.
+	unsigned char *converted;
+	size_t pending_size;
+	bool has_pending;
+	bool stopping;
+	bool write_failed;
+
+	// Protected by the mutex.
+	long frames_received;
+	long frames_written;
+	long frames_dropped;
+	uint64_t bytes_written;
+};
+
+static volatile bool stop_requested = false;
+static bool verbose = false;
+
+static void log_to_stderr(int log_level, const char *format, va_list args, void *param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (log_level <= LOG_INFO || verbose)
+	{
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+	}
+}
+
+static void handle_interrupt(int signal_number)
+{
+	UNUSED_PARAMETER(signal_number);
+	stop_requested = true;
+}
+
+static size_t output_frame_size(enum output_format format, enum ntr_screen screen)
+{
+	switch (format)
+	{
+	case OUTPUT_RGBA:
+		return SCREEN_WIDTH[screen] * SCREEN_HEIGHT[screen] * 4;
+	case OUTPUT_YUV420P:
+		return SCREEN_WIDTH[screen] * SCREEN_HEIGHT[screen] * 3 / 2;
+	default:
+		return DATA_PACKET_DATA_SIZE * DATA_PACKET_MAX_COUNT;
+	}
+}
+
+// Decoded frames are rotated: SCREEN_HEIGHT pixels wide and SCREEN_WIDTH pixels tall. Upright pixel
+// (x, y) is decoded pixel (SCREEN_HEIGHT - 1 - y, x).
+static void convert_rgba(const unsigned char *image_data, enum ntr_screen screen, unsigned char *output)
+{
+	int width = SCREEN_WIDTH[screen];
+	int height = SCREEN_HEIGHT[screen];
+	const uint32_t *source = (const uint32_t *)image_data;
+	uint32_t *destination = (uint32_t *)output;
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			destination[y * width + x] = source[x * height + (height - 1 - y)];
+		}
+	}
+}
+
+// BT.601 limited range, with chroma averaged over each 2x2 block.
+static void convert_yuv420p(const unsigned char *image_data, enum ntr_screen screen, unsigned char *output)
+{
+	int width = SCREEN_WIDTH[screen];
+	int height = SCREEN_HEIGHT[screen];
+	unsigned char *y_plane = output;
+	unsigned char *u_plane = y_plane + width * height;
+	unsigned char *v_plane = u_plane + (width / 2) * (height / 2);
+
+	for (int y = 0; y < height; y += 2)
+	{
+		for (int x = 0; x < width; x += 2)
+		{
+			int r_sum = 0;
+			int g_sum = 0;
+			int b_sum = 0;
+
+			for (int block_y = 0; block_y < 2; block_y++)
+			{
+				for (int block_x = 0; block_x < 2; block_x++)
+				{
+					const unsigned char *pixel = image_data + ((x + block_x) * height + (height - 1 - (y + block_y))) * 4;
+					int r = pixel[0];
+					int g = pixel[1];
+					int b = pixel[2];
+
+					y_plane[(y + block_y) * width + x + block_x] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+
+					r_sum += r;
+					g_sum += g;
+					b_sum += b;
+				}
+			}
+
+			int r = r_sum / 4;
+			int g = g_sum / 4;
+			int b = b_sum / 4;
+			u_plane[(y / 2) * (width / 2) + x / 2] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			v_plane[(y / 2) * (width / 2) + x / 2] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+}
+
+// Called on the network thread once the back buffer holds a new frame.
+static void receiver_submit(struct receiver *receiver, size_t size)
+{
+	pthread_mutex_lock(&receiver->mutex);
+
+	receiver->frames_received++;
+
+	while (receiver->has_pending && !receiver->low_latency && !receiver->stopping)
+	{
+		pthread_cond_wait(&receiver->cond, &receiver->mutex);
+	}
+
+	if (receiver->has_pending)
+	{
+		// The writer hasn't gotten to the last frame yet; replace it with this one.
+		receiver->frames_dropped++;
+	}
+
+	unsigned char *swap = receiver->pending;
+	receiver->pending = receiver->back;
+	receiver->back = swap;
+	receiver->pending_size = size;
+	receiver->has_pending = true;
+
+	pthread_cond_broadcast(&receiver->cond);
+	pthread_mutex_unlock(&receiver->mutex);
+}
+
+// Keeps the connection's image buffer, giving it the spare back buffer to decode into next.
+static unsigned char *receiver_frame_decoded(void *param, enum ntr_screen screen, unsigned char *image_data)
+{
+	struct receiver *receiver = param;
+
+	if (screen != receiver->screen)
+	{
+		return image_data;
+	}
+
+	unsigned char *spare = receiver->back;
+	receiver->back = image_data;
+	receiver_submit(receiver, output_frame_size(receiver->format, screen));
+
+	return spare;
+}
+
+static void receiver_frame_received(void *param, enum ntr_screen screen, const unsigned char *frame_data, int frame_size)
+{
+	struct receiver *receiver = param;
+
+	if (screen != receiver->screen || receiver->format != OUTPUT_MJPEG)
+	{
+		return;
+	}
+
+	memcpy(receiver->back, frame_data, frame_size);
+	receiver_submit(receiver, frame_size);
+}
+
+static void *receiver_writer_thread_run(void *data)
+{
+	struct receiver *receiver = data;
+
+	while (true)
+	{
+		pthread_mutex_lock(&receiver->mutex);
+
+		while (!receiver->has_pending && !receiver->stopping)
+		{
+			pthread_cond_wait(&receiver->cond, &receiver->mutex);
+		}
+
+		if (!receiver->has_pending)
+		{
+			pthread_mutex_unlock(&receiver->mutex);
+			break;
+		}
+
+		unsigned char *swap = receiver->front;
+		receiver->front = receiver->pending;
+		receiver->pending = swap;
+		size_t size = receiver->pending_size;
+		receiver->has_pending = false;
+
+		pthread_cond_broadcast(&receiver->cond);
+		pthread_mutex_unlock(&receiver->mutex);
+
+		const unsigned char *output_data = receiver->front;
+		if (receiver->format == OUTPUT_YUV420P)
+		{
+			convert_yuv420p(receiver->front, receiver->screen, receiver->converted);
+			output_data = receiver->converted;
+		}
+		else if (receiver->format == OUTPUT_RGBA)
+		{
+			convert_rgba(receiver->front, receiver->screen, receiver->converted);
+			output_data = receiver->converted;
+		}
+
+		bool written = fwrite(output_data, 1, size, receiver->output) == size;
+
+		pthread_mutex_lock(&receiver->mutex);
+		if (written)
+		{
+			receiver->frames_written++;
+			receiver->bytes_written += size;
+		}
+		else
+		{
+			// Most likely the consumer went away.
+			receiver->write_failed = true;
+			receiver->stopping = true;
+			pthread_cond_broadcast(&receiver->cond);
+		}
+		pthread_mutex_unlock(&receiver->mutex);
+
+		if (!written)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static FILE *open_output(const char *path)
+{
+	if (strcmp(path, "-") == 0)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return stdout;
+	}
+
+#ifdef _WIN32
+	if (strncmp(path, "\\\\.\\pipe\\", 9) == 0)
+	{
+		HANDLE pipe = CreateNamedPipeA(path, PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1,
+			(DWORD)output_frame_size(OUTPUT_RGBA, SCREEN_TOP) * 2, 0, 0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			return NULL;
+		}
+
+		blog(LOG_INFO, "ntr-receive: Waiting for a reader to connect to %s", path);
+		if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+		{
+			CloseHandle(pipe);
+			return NULL;
+		}
+
+		return _fdopen(_open_osfhandle((intptr_t)pipe, 0), "wb");
+	}
+#endif
+
+	// Also covers FIFOs; this blocks until a reader opens the other end.
+	return fopen(path, "wb");
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"usage: ntr-receive [options]\n"
+		"\n"
+		"  --ip <address>             send NTR the remote view startup command first\n"
+		"  --quality <10-100>         picture quality for the startup command (default 80)\n"
+		"  --qos <0-101>              quality of service for the startup command (default 100)\n"
+		"  --priority-screen <screen> top or bottom (default top)\n"
+		"  --priority-factor <0-10>   (default 2)\n"
+		"\n"
+		"  --screen <screen>          screen to output, top or bottom (default top)\n"
+		"  --format <format>          rgba, yuv420p (both upright), or mjpeg (as sent by NTR,\n"
+		"                             rotated 90 degrees counterclockwise) (default rgba)\n"
+		"  --output <path>            file, FIFO, or \\\\.\\pipe\\name to write to (default -, stdout)\n"
+		"  --low-latency              drop frames instead of waiting when the output falls behind\n"
+		"  --no-stream-decode         only decode frames once they're complete\n"
+		"  --trace <path>             record every packet received, for ntr-advisor\n"
+		"  --stats-interval <seconds> how often to report throughput on stderr (default 5, 0 for never)\n"
+		"  --verbose                  include debug logging\n");
+}
+
+static bool parse_screen(const char *value, enum ntr_screen *screen)
+{
+	if (strcmp(value, "top") == 0)
+	{
+		*screen = SCREEN_TOP;
+		return true;
+	}
+	else if (strcmp(value, "bottom") == 0)
+	{
+		*screen = SCREEN_BOTTOM;
+		return true;
+	}
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	struct ntr_connection_setup setup;
+	memset(&setup, 0, sizeof(struct ntr_connection_setup));
+	setup.quality = 80;
+	setup.qos = 100;
+	setup.priority_factor = 2;
+	setup.priority_screen = SCREEN_TOP;
+	setup.stream_decode = true;
+
+	struct receiver receiver;
+	memset(&receiver, 0, sizeof(struct receiver));
+	receiver.format = OUTPUT_RGBA;
+	receiver.screen = SCREEN_TOP;
+
+	const char *output_path = "-";
+	int stats_interval = 5;
+
+	for (int arg_index = 1; arg_index < argc; arg_index++)
+	{
+		const char *arg = argv[arg_index];
+		const char *value = arg_index + 1 < argc ? argv[arg_index + 1] : NULL;
+		bool used_value = true;
+
+		if (strcmp(arg, "--low-latency") == 0)
+		{
+			receiver.low_latency = true;
+			used_value = false;
+		}
+		else if (strcmp(arg, "--no-stream-decode") == 0)
+		{
+			setup.stream_decode = false;
+			used_value = false;
+		}
+		else if (strcmp(arg, "--verbose") == 0)
+		{
+			verbose = true;
+			used_value = false;
+		}
+		else if (value == NULL)
+		{
+			print_usage();
+			return 1;
+		}
+		else if (strcmp(arg, "--ip") == 0)
+		{
+			dstr_copy(&setup.ip_address, value);
+		}
+		else if (strcmp(arg, "--quality") == 0)
+		{
+			setup.quality = atoi(value);
+		}
+		else if (strcmp(arg, "--qos") == 0)
+		{
+			setup.qos = atoi(value);
+		}
+		else if (strcmp(arg, "--priority-factor") == 0)
+		{
+			setup.priority_factor = atoi(value);
+		}
+		else if (strcmp(arg, "--priority-screen") == 0 && parse_screen(value, &setup.priority_screen))
+		{
+		}
+		else if (strcmp(arg, "--screen") == 0 && parse_screen(value, &receiver.screen))
+		{
+		}
+		else if (strcmp(arg, "--format") == 0 && strcmp(value, "rgba") == 0)
+		{
+			receiver.format = OUTPUT_RGBA;
+		}
+		else if (strcmp(arg, "--format") == 0 && strcmp(value, "yuv420p") == 0)
+		{
+			receiver.format = OUTPUT_YUV420P;
+		}
+		else if (strcmp(arg, "--format") == 0 && strcmp(value, "mjpeg") == 0)
+		{
+			receiver.format = OUTPUT_MJPEG;
+		}
+		else if (strcmp(arg, "--output") == 0)
+		{
+			output_path = value;
+		}
+		else if (strcmp(arg, "--trace") == 0)
+		{
+			dstr_copy(&setup.trace_file_path, value);
+		}
+		else if (strcmp(arg, "--stats-interval") == 0)
+		{
+			stats_interval = atoi(value);
+		}
+		else
+		{
+			print_usage();
+			return 1;
+		}
+
+		if (used_value)
+		{
+			arg_index++;
+		}
+	}
+
+	base_set_log_handler(log_to_stderr, NULL);
+
+#ifdef _WIN32
+	WSADATA winsock_data;
+	WSAStartup(MAKEWORD(2, 2), &winsock_data);
+#endif
+
+	if (!dstr_is_empty(&setup.ip_address) && !obs_ntr_send_remoteview_startup(&setup))
+	{
+		return 1;
+	}
+
+	receiver.output = open_output(output_path);
+	if (receiver.output == NULL)
+	{
+		blog(LOG_ERROR, "ntr-receive: Unable to open %s for output", output_path);
+		return 1;
+	}
+	setvbuf(receiver.output, NULL, _IONBF, 0);
+
+	// Decoded images are exchanged with the connection, so their buffers have to be the size it
+	// decodes into.
+	size_t frame_capacity = receiver.format == OUTPUT_MJPEG ? output_frame_size(OUTPUT_MJPEG, receiver.screen) : TEMP_BUFFER_SIZE;
+	receiver.back = bmalloc(frame_capacity);
+	receiver.pending = bmalloc(frame_capacity);
+	receiver.front = bmalloc(frame_capacity);
+	if (receiver.format != OUTPUT_MJPEG)
+	{
+		receiver.converted = bmalloc(output_frame_size(receiver.format, receiver.screen));
+	}
+
+	pthread_mutex_init_value(&receiver.mutex);
+	pthread_mutex_init(&receiver.mutex, NULL);
+	pthread_cond_init(&receiver.cond, NULL);
+	pthread_create(&receiver.writer_thread, NULL, receiver_writer_thread_run, &receiver);
+
+	struct ntr_stats stats;
+	memset(&stats, 0, sizeof(struct ntr_stats));
+	volatile long decode_demand[SCREEN_COUNT] = { 0 };
+	volatile long compressed_demand[SCREEN_COUNT] = { 0 };
+	if (receiver.format == OUTPUT_MJPEG)
+	{
+		compressed_demand[receiver.screen] = 1;
+	}
+	else
+	{
+		decode_demand[receiver.screen] = 1;
+	}
+
+	FILE *trace_file = NULL;
+	if (!dstr_is_empty(&setup.trace_file_path))
+	{
+		trace_file = obs_ntr_trace_create(setup.trace_file_path.array, &setup);
+		if (trace_file == NULL)
+		{
+			return 1;
+		}
+	}
+
+	struct ntr_connection_data *connection_data = obs_ntr_connection_alloc();
+	connection_data->stream_decode = setup.stream_decode;
+	connection_data->priority_factor = setup.priority_factor;
+	connection_data->priority_screen = setup.priority_screen;
+	connection_data->stats = &stats;
+	connection_data->decode_demand = decode_demand;
+	connection_data->compressed_demand = compressed_demand;
+	connection_data->frame_decoded = receiver_frame_decoded;
+	connection_data->frame_received = receiver_frame_received;
+	connection_data->callback_param = &receiver;
+	connection_data->trace_file = trace_file;
+	connection_data->keep_latest_frame = false;
+
+	signal(SIGINT, handle_interrupt);
+
+	obs_ntr_connection_start(connection_data);
+
+	uint64_t start_time = os_gettime_ns();
+	uint64_t last_report_time = start_time;
+	long last_frames_written = 0;
+	uint64_t last_bytes_written = 0;
+
+	while (!stop_requested && !connection_data->net_thread_exited && !receiver.write_failed)
+	{
+		os_sleep_ms(100);
+
+		uint64_t now = os_gettime_ns();
+		if (stats_interval > 0 && now - last_report_time >= (uint64_t)stats_interval * 1000000000ULL)
+		{
+			pthread_mutex_lock(&receiver.mutex);
+			long frames_received = receiver.frames_received;
+			long frames_written = receiver.frames_written;
+			long frames_dropped = receiver.frames_dropped;
+			uint64_t bytes_written = receiver.bytes_written;
+			pthread_mutex_unlock(&receiver.mutex);
+
+			double elapsed_seconds = (now - last_report_time) / 1000000000.0;
+			struct ntr_screen_stats *screen_stats = &stats.screens[receiver.screen];
+
+			blog(LOG_INFO, "ntr-receive: %.1f fps written (%.2f MB/s); %ld received, %ld written, %ld dropped by output; "
+				"%ld frames dropped and %ld packets lost by network; decode %.2f ms",
+				(frames_written - last_frames_written) / elapsed_seconds,
+				(bytes_written - last_bytes_written) / elapsed_seconds / (1024.0 * 1024.0),
+				frames_received, frames_written, frames_dropped,
+				os_atomic_load_long(&screen_stats->frames_dropped), os_atomic_load_long(&screen_stats->packets_lost),
+				os_atomic_load_long(&screen_stats->decode_us) / 1000.0);
+
+			last_report_time = now;
+			last_frames_written = frames_written;
+			last_bytes_written = bytes_written;
+		}
+	}
+
+	obs_ntr_connection_free(connection_data);
+
+	pthread_mutex_lock(&receiver.mutex);
+	receiver.stopping = true;
+	pthread_cond_broadcast(&receiver.cond);
+	pthread_mutex_unlock(&receiver.mutex);
+	pthread_join(receiver.writer_thread, NULL);
+
+	blog(LOG_INFO, "ntr-receive: %ld frames received, %ld written, %ld dropped by output in %.1f seconds",
+		receiver.frames_received, receiver.frames_written, receiver.frames_dropped,
+		(os_gettime_ns() - start_time) / 1000000000.0);
+
+	if (trace_file != NULL)
+	{
+		fclose(trace_file);
+	}
+
+	if (receiver.output != stdout)
+	{
+		fclose(receiver.output);
+	}
+
+	pthread_cond_destroy(&receiver.cond);
+	pthread_mutex_destroy(&receiver.mutex);
+	bfree(receiver.back);
+	bfree(receiver.pending);
+	bfree(receiver.front);
+	bfree(receiver.converted);
+	dstr_free(&setup.ip_address);
+	dstr_free(&setup.trace_file_path);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+// Stand-ins for the few libobs utility functions that the connection code and the command line
+// tools use, so the tools don't need libobs (and everything it loads) to run. Anything declared
+// inline in the libobs headers, like bzalloc, dstr_is_empty and the atomics, comes from the
+// headers as usual.
+
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+static log_handler_t log_handler = NULL;
+static void *log_param = NULL;
+
+void base_set_log_handler(log_handler_t handler, void *param)
+{
+	log_handler = handler;
+	log_param = param;
+}
+
+void blog(int log_level, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	if (log_handler != NULL)
+	{
+		log_handler(log_level, format, args, log_param);
+	}
+	else if (log_level <= LOG_INFO)
+	{
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+	}
+
+	va_end(args);
+}
+
+void *bmalloc(size_t size)
+{
+	void *ptr = malloc(size != 0 ? size : 1);
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "Out of memory allocating %lu bytes\n", (unsigned long)size);
+		abort();
+	}
+
+	return ptr;
+}
+
+void *brealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size != 0 ? size : 1);
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "Out of memory allocating %lu bytes\n", (unsigned long)size);
+		abort();
+	}
+
+	return ptr;
+}
+
+void bfree(void *ptr)
+{
+	free(ptr);
+}
+
+void dstr_copy(struct dstr *dst, const char *array)
+{
+	bfree(dst->array);
+	dst->array = NULL;
+	dst->len = 0;
+	dst->capacity = 0;
+
+	if (array != NULL && *array != 0)
+	{
+		dst->len = strlen(array);
+		dst->capacity = dst->len + 1;
+		dst->array = bmalloc(dst->capacity);
+		memcpy(dst->array, array, dst->capacity);
+	}
+}
+
+uint64_t os_gettime_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL +
+		(uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void os_sleep_ms(uint32_t duration)
+{
+#ifdef _WIN32
+	Sleep(duration);
+#else
+	usleep(duration * 1000);
+#endif
+}
+
+// Paths are UTF-8, as they are throughout OBS.
+FILE *os_fopen(const char *path, const char *mode)
+{
+#ifdef _WIN32
+	wchar_t wide_path[MAX_PATH];
+	wchar_t wide_mode[16];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, MAX_PATH) == 0 ||
+		MultiByteToWideChar(CP_UTF8, 0, mode, -1, wide_mode, 16) == 0)
+	{
+		return NULL;
+	}
+
+	return _wfopen(wide_path, wide_mode);
+#else
+	return fopen(path, mode);
+#endif
+}